@@ -0,0 +1,236 @@
+/* =========================================================================================
+*
+*	Purpose:	Replacement global operator new / delete backed by Memory Manager pools
+*	Author:		Sreyash (Srey) Raychaudhuri
+*	Date:		12/22/2024
+*
+*	Opt-in: link this file into a program and every new / delete of up to NEW_MAX_POOLED_SIZE bytes goes through per-CPU cached pools.
+*	It is excluded from the Visual Studio build of the test program.
+*	Sized delete (on by default in C++14 and later; /Zc:sizedDealloc in MSVC, -fsized-deallocation in GCC and Clang) hands the size class
+*	straight to the pools. Unsized delete has to look the pointer up first
+*
+* ==========================================================================================
+*/
+
+#include <cstdlib>
+#include <new>
+
+#include "PerCpuMemoryManager.h"
+
+// Largest object served from a pool. Larger ones come from malloc()
+#define NEW_MAX_POOLED_SIZE	4096
+
+// Slab size of every pool
+#define NEW_SLAB_BYTES		(64 * 1024)
+
+namespace
+{
+	// Set while the calling thread is inside the Memory Manager, whose own containers then allocate from malloc()
+	thread_local bool tInsideManager = false;
+
+	// Manager constructed in place by the first new, which may come from a static constructor in any translation unit.
+	// Never destroyed, as objects may still be deleted by static destructors
+	alignas(PerCpuMemoryManager) char gManagerStorage[sizeof(PerCpuMemoryManager)];
+	std::atomic<PerCpuMemoryManager*> gManager{ nullptr };
+	std::atomic<int> gInitializing{ 0 };
+
+	class ManagerScope
+	{
+	public:
+		ManagerScope() { tInsideManager = true; }
+		~ManagerScope() { tInsideManager = false; }
+	};
+
+	PerCpuMemoryManager* GetManager()
+	{
+		PerCpuMemoryManager* manager = gManager.load(std::memory_order_acquire);
+		if (manager)
+		{
+			return manager;
+		}
+
+		int expected = 0;
+		if (gInitializing.compare_exchange_strong(expected, 1, std::memory_order_acq_rel))
+		{
+			ManagerScope scope;
+			manager = new (gManagerStorage) PerCpuMemoryManager(MemoryManagerConfig::General(NEW_MAX_POOLED_SIZE, NEW_SLAB_BYTES));
+			gManager.store(manager, std::memory_order_release);
+			return manager;
+		}
+
+		while (!(manager = gManager.load(std::memory_order_acquire)))
+		{
+			std::this_thread::yield();
+		}
+
+		return manager;
+	}
+
+	// Size requested from the pools for size bytes aligned to alignment, SIZE_MAX if the object does not go into a pool.
+	// Pool blocks are aligned up to a cache line when their size is a multiple of the alignment, and every size class up to
+	// that alignment rounds up to one that is. Allocation and sized deallocation must agree on this
+	size_t GetPooledSize(size_t size, size_t alignment)
+	{
+		if (alignment > CACHE_LINE_SIZE)
+		{
+			return SIZE_MAX;
+		}
+
+		size_t pooledSize = (std::max<size_t>(size, 1) + alignment - 1) / alignment * alignment;
+		return (pooledSize <= NEW_MAX_POOLED_SIZE) ? pooledSize : SIZE_MAX;
+	}
+
+	void* AllocateUnpooled(size_t size, size_t alignment)
+	{
+		size = std::max<size_t>(size, 1);
+		if (alignment <= alignof(std::max_align_t))
+		{
+			return malloc(size);
+		}
+
+#if defined(_WIN32)
+		return _aligned_malloc(size, alignment);
+#else
+		void* block = nullptr;
+		return posix_memalign(&block, alignment, size) == 0 ? block : nullptr;
+#endif
+	}
+
+	void FreeUnpooled(void* block, size_t alignment)
+	{
+#if defined(_WIN32)
+		if (alignment > alignof(std::max_align_t))
+		{
+			_aligned_free(block);
+			return;
+		}
+#else
+		(void)alignment;
+#endif
+		free(block);
+	}
+
+	// One attempt at an allocation. nullptr on failure
+	void* TryAllocate(size_t size, size_t alignment)
+	{
+		if (tInsideManager)
+		{
+			return AllocateUnpooled(size, alignment);
+		}
+
+		size_t pooledSize = GetPooledSize(size, alignment);
+		if (pooledSize == SIZE_MAX)
+		{
+			return AllocateUnpooled(size, alignment);
+		}
+
+		PerCpuMemoryManager* manager = GetManager();
+		ManagerScope scope;
+		return manager->Allocate(pooledSize);
+	}
+
+	// Allocation as operator new does it: call the new-handler until it succeeds, nullptr once there is no handler
+	void* AllocateOrHandle(size_t size, size_t alignment)
+	{
+		for (;;)
+		{
+			void* block = TryAllocate(size, alignment);
+			if (block)
+			{
+				return block;
+			}
+
+			std::new_handler handler = std::get_new_handler();
+			if (!handler)
+			{
+				return nullptr;
+			}
+
+			handler();
+		}
+	}
+
+	void* AllocateOrThrow(size_t size, size_t alignment)
+	{
+		void* block = AllocateOrHandle(size, alignment);
+		if (!block)
+		{
+			throw std::bad_alloc();
+		}
+
+		return block;
+	}
+
+	// Sized deallocation: the size class follows from the size, no lookup needed
+	void FreeSized(void* block, size_t size, size_t alignment)
+	{
+		if (!block)
+		{
+			return;
+		}
+
+		PerCpuMemoryManager* manager = gManager.load(std::memory_order_acquire);
+		size_t pooledSize = GetPooledSize(size, alignment);
+		if (tInsideManager || !manager || pooledSize == SIZE_MAX)
+		{
+			FreeUnpooled(block, alignment);
+			return;
+		}
+
+		ManagerScope scope;
+		manager->Free(block, pooledSize);
+	}
+
+	// Unsized deallocation: find the pool of the block, if it came from one
+	void FreeUnsized(void* block, size_t alignment)
+	{
+		if (!block)
+		{
+			return;
+		}
+
+		PerCpuMemoryManager* manager = gManager.load(std::memory_order_acquire);
+		if (tInsideManager || !manager || alignment > CACHE_LINE_SIZE)
+		{
+			FreeUnpooled(block, alignment);
+			return;
+		}
+
+		ManagerScope scope;
+		size_t blockSize = manager->GetBlockSize(block);
+		if (blockSize)
+		{
+			manager->Free(block, blockSize);
+			return;
+		}
+
+		FreeUnpooled(block, alignment);
+	}
+}
+
+
+void* operator new(size_t size) { return AllocateOrThrow(size, alignof(std::max_align_t)); }
+void* operator new[](size_t size) { return AllocateOrThrow(size, alignof(std::max_align_t)); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return AllocateOrHandle(size, alignof(std::max_align_t)); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return AllocateOrHandle(size, alignof(std::max_align_t)); }
+
+void operator delete(void* block) noexcept { FreeUnsized(block, alignof(std::max_align_t)); }
+void operator delete[](void* block) noexcept { FreeUnsized(block, alignof(std::max_align_t)); }
+void operator delete(void* block, const std::nothrow_t&) noexcept { FreeUnsized(block, alignof(std::max_align_t)); }
+void operator delete[](void* block, const std::nothrow_t&) noexcept { FreeUnsized(block, alignof(std::max_align_t)); }
+void operator delete(void* block, size_t size) noexcept { FreeSized(block, size, alignof(std::max_align_t)); }
+void operator delete[](void* block, size_t size) noexcept { FreeSized(block, size, alignof(std::max_align_t)); }
+
+#if defined(__cpp_aligned_new)
+void* operator new(size_t size, std::align_val_t alignment) { return AllocateOrThrow(size, static_cast<size_t>(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment) { return AllocateOrThrow(size, static_cast<size_t>(alignment)); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return AllocateOrHandle(size, static_cast<size_t>(alignment)); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return AllocateOrHandle(size, static_cast<size_t>(alignment)); }
+
+void operator delete(void* block, std::align_val_t alignment) noexcept { FreeUnsized(block, static_cast<size_t>(alignment)); }
+void operator delete[](void* block, std::align_val_t alignment) noexcept { FreeUnsized(block, static_cast<size_t>(alignment)); }
+void operator delete(void* block, std::align_val_t alignment, const std::nothrow_t&) noexcept { FreeUnsized(block, static_cast<size_t>(alignment)); }
+void operator delete[](void* block, std::align_val_t alignment, const std::nothrow_t&) noexcept { FreeUnsized(block, static_cast<size_t>(alignment)); }
+void operator delete(void* block, size_t size, std::align_val_t alignment) noexcept { FreeSized(block, size, static_cast<size_t>(alignment)); }
+void operator delete[](void* block, size_t size, std::align_val_t alignment) noexcept { FreeSized(block, size, static_cast<size_t>(alignment)); }
+#endif // __cpp_aligned_new
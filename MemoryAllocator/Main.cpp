@@ -1,11 +1,42 @@
 
 #include "MemoryManager.h"
-#include <cassert>
+#include "SharedMemoryManager.h"
+#include "PerCpuMemoryManager.h"
+#include "Pooled.h"
+#include <random>
+#include <thread>
 #include <time.h>
 #include "stdlib.h"
 
+#if defined(__unix__)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <dlfcn.h>
+#include <linux/perf_event.h>
+#include <linux/seccomp.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
 #define PRINT_DATA(count, value)  printf("Count = %u; Value = %lf", count, value)
 
+// Check of a test. Unlike assert() it is not compiled out of release builds (NDEBUG): a failed check prints where it failed and
+// ends the run with a non-zero exit code. Calls with side effects go before it, so the test does the same work in every build
+#define CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			printf("\n[FAILURE] %s:%d: %s\n", __FILE__, __LINE__, #condition); \
+			exit(1); \
+		} \
+	} while (0)
+
 class Dummy
 {
 	uint64_t mCount;
@@ -22,6 +53,82 @@ public:
 	inline double GetValue() { return mValue; }
 };
 
+// Dummy whose new / delete go through a pool of its own
+class PooledDummy : public Dummy, public Pooled<PooledDummy>
+{
+public:
+	using Dummy::Dummy;
+};
+
+// Block larger than 2 KiB, used to build a pool spanning more than 4 GiB
+struct LargeRecord
+{
+	char mData[64 * 1024];
+};
+
+// Counter of L1 data cache read misses of the calling thread, user space only. Returns -1 where perf events are unavailable
+int OpenL1MissCounter()
+{
+#if defined(__linux__)
+	perf_event_attr attributes;
+	memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = PERF_TYPE_HW_CACHE;
+	attributes.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attributes.disabled = 1;
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+
+	int fd = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+	if (fd >= 0)
+	{
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+// Stop and close a counter from OpenL1MissCounter. Returns its count, -1 if it never opened
+long long ClosePerfCounter(int fd)
+{
+	long long count = -1;
+#if defined(__linux__)
+	if (fd >= 0)
+	{
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &count, sizeof(count)) != sizeof(count))
+		{
+			count = -1;
+		}
+		close(fd);
+	}
+#else
+	(void)fd;
+#endif
+	return count;
+}
+
+// Set an environment variable, or remove it if value is nullptr
+void SetEnvironmentValue(const char* name, const char* value)
+{
+#if defined(_MSC_VER)
+	_putenv_s(name, value ? value : "");
+#else
+	if (value)
+	{
+		setenv(name, value, 1);
+	}
+	else
+	{
+		unsetenv(name);
+	}
+#endif
+}
+
 int main()
 {
 	srand(time(NULL));
@@ -78,6 +185,828 @@ int main()
 	memoryManager->Free(&ptr[randIndices[1]]); // Pointer itself Invalidated by previous free
 	memoryManager->Free(&d1); // Should be successful
 
+	// TEST 5: Enumerate live blocks. Every pointer still held in ptr[] must be reported live
+	size_t liveCount = memoryManager->CountLive(sizeof(Dummy));
+	size_t heldCount = 0;
+	memoryManager->ForEachLive(sizeof(Dummy), [&](void* block)
+		{
+			for (int index = 0; index < poolSize + 21; index++)
+			{
+				if (ptr[index] == block)
+				{
+					heldCount++;
+					break;
+				}
+			}
+		});
+
+	printf("\nLive blocks = %zu; Held in ptr[] = %zu\n", liveCount, heldCount);
+
+	// TEST 6: Request-scoped allocations. The whole pool is released at the end of the scope, so it can be refilled completely
+	memoryManager->Reset(sizeof(Dummy));
+	{
+		ScopedArena arena(*memoryManager, sizeof(Dummy));
+		int allocatedCount = 0;
+		while (arena.Allocate<Dummy>())
+		{
+			allocatedCount++;
+		}
+		CHECK(allocatedCount == poolSize);
+	}
+	CHECK(memoryManager->CountLive(sizeof(Dummy)) == 0);
+
+	// TEST 7: Handles. Unlike d0/d1 above, every copy of a handle goes stale when its block is freed
+	{
+		MemoryManager handleMemoryManager(poolSize);
+		Handle<Dummy> h0 = handleMemoryManager.AllocateHandle<Dummy>();
+		Handle<Dummy> h0Copy = h0;
+		CHECK(handleMemoryManager.Resolve(h0Copy) != nullptr);
+
+		handleMemoryManager.Free(&h0);
+		CHECK(!h0 && handleMemoryManager.Resolve(h0Copy) == nullptr);
+
+		// Block gets reused (LIFO), but the old handle still does not resolve to it
+		Handle<Dummy> h1 = handleMemoryManager.AllocateHandle<Dummy>();
+		CHECK(h1.mIndex == h0Copy.mIndex && handleMemoryManager.Resolve(h0Copy) == nullptr);
+		handleMemoryManager.Free(&h0Copy); // Stale handle
+
+		// Handles for pointer allocations, and invalidation by Reset()
+		Dummy* d = handleMemoryManager.Allocate<Dummy>();
+		Handle<Dummy> h2 = handleMemoryManager.GetHandle(d);
+		CHECK(handleMemoryManager.Resolve(h2) == d);
+		handleMemoryManager.Reset();
+		d = handleMemoryManager.Allocate<Dummy>();
+		CHECK(handleMemoryManager.Resolve(h2) == nullptr && handleMemoryManager.Resolve(h1) == nullptr);
+
+		// A handle taken after Reset() starts over from the first slot, which handles from before it still do not resolve through
+		Handle<Dummy> h3 = handleMemoryManager.GetHandle(d);
+		CHECK(h3.mIndex == h1.mIndex && handleMemoryManager.Resolve(h3) == d && handleMemoryManager.Resolve(h1) == nullptr);
+		handleMemoryManager.Free(&d);
+		CHECK(d == nullptr && handleMemoryManager.CountLive(sizeof(Dummy)) == 0);
+	}
+
+	// TEST 8: Pools from a config. The 16 byte pool starts at 4 blocks and doubles when it runs out, up to 12 blocks
+	{
+		MemoryManagerConfig config;
+		bool parsed = config.Parse("8 4; 16 4 growth=double backing=heap max=12 # Dummy; 64 2 growth=linear backing=mmap");
+		CHECK(parsed);
+		CHECK(config.mSizeClasses.size() == 3 && config.mSizeClasses[1].mGrowthPolicy == GrowthPolicy::Double && config.mSizeClasses[1].mMaxBlocks == 12);
+
+		// Malformed entries are rejected: a bad block count, a field without a key (the positional form), an unknown key, a bad value
+		bool parsedMalformed[4] = { config.Parse("16 four"), config.Parse("16 4 double"), config.Parse("16 4 colour=red"), config.Parse("16 4 max=lots") };
+		CHECK(!parsedMalformed[0] && !parsedMalformed[1] && !parsedMalformed[2] && !parsedMalformed[3]);
+
+		// Keys come in any order, and only the ones given change
+		MemoryManagerConfig orderedConfig;
+		bool parsedOrdered = orderedConfig.Parse("32 4 fault=prefault reuse=lowest quota=64");
+		CHECK(parsedOrdered && orderedConfig.mSizeClasses[0].mFaultPolicy == FaultPolicy::Prefault && orderedConfig.mSizeClasses[0].mQuotaBytes == 64);
+		CHECK(orderedConfig.mSizeClasses[0].mReusePolicy == ReusePolicy::LowestAddress && orderedConfig.mSizeClasses[0].mGrowthPolicy == GrowthPolicy::None);
+
+		// The same text from a file, and from the environment: the file MEMORY_MANAGER_CONFIG_FILE names first, then MEMORY_MANAGER_CONFIG on top
+		const char* configPath = "MemoryAllocatorTest.cfg";
+		FILE* configFile = fopen(configPath, "w");
+		CHECK(configFile != nullptr);
+		fputs("# Pools of TEST 8\nbudget 4096\n16 32 growth=linear\n64 8 reuse=lowest\n", configFile);
+		fclose(configFile);
+
+		MemoryManagerConfig fileConfig;
+		bool loaded = fileConfig.LoadFromFile(configPath);
+		CHECK(loaded && fileConfig.mBudgetBytes == 4096 && fileConfig.mSizeClasses.size() == 2);
+		CHECK(fileConfig.mSizeClasses[0].mGrowthPolicy == GrowthPolicy::Linear && fileConfig.mSizeClasses[1].mReusePolicy == ReusePolicy::LowestAddress);
+		bool loadedMissing = fileConfig.LoadFromFile("MemoryAllocatorTest.missing.cfg");
+		CHECK(!loadedMissing);
+
+		SetEnvironmentValue("MEMORY_MANAGER_CONFIG_FILE", configPath);
+		SetEnvironmentValue("MEMORY_MANAGER_CONFIG", "budget 8192");
+		MemoryManagerConfig environmentConfig;
+		bool loadedEnvironment = environmentConfig.LoadFromEnvironment();
+		CHECK(loadedEnvironment && environmentConfig.mSizeClasses.size() == 2 && environmentConfig.mBudgetBytes == 8192);
+
+		// A variable that is set but does not parse fails the load
+		SetEnvironmentValue("MEMORY_MANAGER_CONFIG", "16 four");
+		loadedEnvironment = environmentConfig.LoadFromEnvironment();
+		CHECK(!loadedEnvironment);
+
+		SetEnvironmentValue("MEMORY_MANAGER_CONFIG_FILE", nullptr);
+		SetEnvironmentValue("MEMORY_MANAGER_CONFIG", nullptr);
+		remove(configPath);
+
+		MemoryManager configuredMemoryManager(config);
+		Dummy* dummies[13];
+		int allocatedCount = 0;
+		while ((dummies[allocatedCount] = configuredMemoryManager.Allocate<Dummy>()) != nullptr)
+		{
+			allocatedCount++;
+		}
+		CHECK(allocatedCount == 12);
+
+		// Blocks of grown chunks are freed back to their own chunk
+		for (int index = 0; index < allocatedCount; index++)
+		{
+			configuredMemoryManager.Free(&dummies[index]);
+		}
+		CHECK(configuredMemoryManager.CountLive(sizeof(Dummy)) == 0);
+
+		// Sizes between size classes are served from the next larger one
+		CHECK(configuredMemoryManager.GetSizeClass(24) == 64);
+	}
+
+	// TEST 9: Free from another thread. Blocks are queued and the owner takes them back once its free list runs dry
+	{
+		MemoryManager ownerMemoryManager(poolSize);
+		Dummy* dummies[1000];
+		for (int index = 0; index < poolSize; index++)
+		{
+			dummies[index] = ownerMemoryManager.Allocate<Dummy>();
+		}
+		Dummy* overflowDummy = ownerMemoryManager.Allocate<Dummy>();
+		CHECK(overflowDummy == nullptr);
+
+		std::thread consumer([&]()
+			{
+				for (int index = 0; index < poolSize; index++)
+				{
+					ownerMemoryManager.Free(&dummies[index]);
+				}
+			});
+		consumer.join();
+
+		dummies[0] = ownerMemoryManager.Allocate<Dummy>();
+		CHECK(dummies[0] != nullptr);
+		CHECK(ownerMemoryManager.CountLive(sizeof(Dummy)) == 1);
+		ownerMemoryManager.Free(&dummies[0]);
+	}
+
+#if defined(__unix__)
+	// TEST 10: Hand a block to another process. It maps the segment at its own address, so only the offset is passed
+	{
+		char segmentName[64];
+		snprintf(segmentName, sizeof(segmentName), "/MemoryAllocatorTest.%d", static_cast<int>(getpid()));
+
+		MemoryManagerConfig config;
+		config.Parse("16 64; 64 16");
+		std::unique_ptr<SharedMemoryManager> producer = SharedMemoryManager::Create(segmentName, config);
+		CHECK(producer);
+
+		int channel[2];
+		int piped = pipe(channel);
+		CHECK(piped == 0);
+
+		pid_t consumerProcess = fork();
+		if (consumerProcess == 0)
+		{
+			std::unique_ptr<SharedMemoryManager> consumer = SharedMemoryManager::Open(segmentName);
+			uint64_t offset = 0;
+			bool received = consumer && read(channel[0], &offset, sizeof(offset)) == sizeof(offset);
+
+			Dummy* dummy = received ? reinterpret_cast<Dummy*>(consumer->ToPointer(offset)) : nullptr;
+			bool consumed = dummy && dummy->GetCount() == 42 && consumer->FreeOffset(offset);
+			_exit(consumed ? 0 : 1);
+		}
+
+		Dummy* dummy = new (producer->Allocate<Dummy>()) Dummy(42, 0.5);
+		uint64_t offset = producer->ToOffset(dummy);
+		ssize_t sent = write(channel[1], &offset, sizeof(offset));
+		CHECK(sent == sizeof(offset));
+
+		int consumerStatus = -1;
+		waitpid(consumerProcess, &consumerStatus, 0);
+		CHECK(WIFEXITED(consumerStatus) && WEXITSTATUS(consumerStatus) == 0);
+		CHECK(producer->CountLive(sizeof(Dummy)) == 0);
+
+		// A segment whose bitfield would lie past its end is rejected instead of read out of bounds
+		int segmentFile = shm_open(segmentName, O_RDWR, 0);
+		void* mappedHeader = segmentFile >= 0 ? mmap(nullptr, sizeof(SharedSegmentHeader), PROT_READ | PROT_WRITE, MAP_SHARED, segmentFile, 0) : MAP_FAILED;
+		CHECK(mappedHeader != MAP_FAILED);
+		SharedSegmentHeader* segmentHeader = static_cast<SharedSegmentHeader*>(mappedHeader);
+		uint64_t bitfieldOffset = segmentHeader->mPools[0].mBitfieldOffset;
+		segmentHeader->mPools[0].mBitfieldOffset = segmentHeader->mSegmentBytes;
+		std::unique_ptr<SharedMemoryManager> corrupted = SharedMemoryManager::Open(segmentName);
+		CHECK(!corrupted);
+		segmentHeader->mPools[0].mBitfieldOffset = bitfieldOffset;
+		munmap(mappedHeader, sizeof(SharedSegmentHeader));
+		close(segmentFile);
+
+		close(channel[0]);
+		close(channel[1]);
+		SharedMemoryManager::Unlink(segmentName);
+	}
+#endif // __unix__
+
+	// TEST 11: Persistent image. Reopening the file gives the pool back as it was at the last Sync(), including the root block
+	{
+		const char* imagePath = "MemoryAllocatorTest.img";
+
+		MemoryManagerConfig config;
+		config.Parse("16 1000");
+		{
+			std::unique_ptr<SharedMemoryManager> image = SharedMemoryManager::CreateImage(imagePath, config);
+			CHECK(image);
+
+			Dummy* root = new (image->Allocate<Dummy>()) Dummy(7, 0.25);
+			Dummy* scratch = image->Allocate<Dummy>();
+			image->Free(&scratch);
+			image->SetRootOffset(image->ToOffset(root));
+			bool synced = image->Sync();
+			CHECK(synced);
+		}
+
+		std::unique_ptr<SharedMemoryManager> image = SharedMemoryManager::OpenImage(imagePath);
+		CHECK(image);
+
+		Dummy* root = reinterpret_cast<Dummy*>(image->ToPointer(image->GetRootOffset()));
+		CHECK(root->GetCount() == 7 && image->CountLive(sizeof(Dummy)) == 1);
+
+		// The freed block is still first on the free list
+		Dummy* reused = image->Allocate<Dummy>();
+		CHECK(reused == root + 1);
+
+		// Closed without a Sync(), the allocation above reached the file but the checksum did not, so the image is refused
+		image.reset();
+		image = SharedMemoryManager::OpenImage(imagePath);
+		CHECK(!image);
+
+		// Unless the destructor syncs it
+		image = SharedMemoryManager::CreateImage(imagePath, config);
+		CHECK(image);
+		image->SetSyncOnClose(true);
+		image.reset();
+		image = SharedMemoryManager::OpenImage(imagePath);
+		CHECK(image && image->CountLive(sizeof(Dummy)) == 0);
+
+		image.reset();
+		remove(imagePath);
+	}
+
+	// TEST 12: Compaction. Sparse chunks are emptied into the densest one and released; handles follow their objects
+	{
+		MemoryManagerConfig config;
+		config.Parse("16 8 growth=linear backing=heap");
+
+		MemoryManager compactedMemoryManager(config);
+		Handle<Dummy> handles[32];
+		for (int index = 0; index < 32; index++)
+		{
+			handles[index] = compactedMemoryManager.AllocateHandle<Dummy>();
+			new (compactedMemoryManager.Resolve(handles[index])) Dummy(index, index * 0.5);
+		}
+
+		// Keep every fourth object: 8 live blocks spread over 4 chunks
+		for (int index = 0; index < 32; index++)
+		{
+			if (index % 4 != 0)
+			{
+				compactedMemoryManager.Free(&handles[index]);
+			}
+		}
+
+		// Incremental: at most 2 moves per call
+		size_t firstMoved = compactedMemoryManager.Compact<Dummy>(2);
+		CHECK(firstMoved == 2);
+		size_t moved = firstMoved + compactedMemoryManager.Compact<Dummy>();
+		size_t movedAgain = compactedMemoryManager.Compact<Dummy>();
+		CHECK(moved == 6 && movedAgain == 0);
+
+		// Survivors now fill a single chunk
+		char* lowest = nullptr;
+		char* highest = nullptr;
+		compactedMemoryManager.ForEachLive(sizeof(Dummy), [&](void* block)
+			{
+				lowest = (!lowest || static_cast<char*>(block) < lowest) ? static_cast<char*>(block) : lowest;
+				highest = (static_cast<char*>(block) > highest) ? static_cast<char*>(block) : highest;
+			});
+		CHECK(highest - lowest == 7 * sizeof(Dummy) && compactedMemoryManager.CountLive(sizeof(Dummy)) == 8);
+
+		for (int index = 0; index < 32; index += 4)
+		{
+			Dummy* dummy = compactedMemoryManager.Resolve(handles[index]);
+			CHECK(dummy && dummy->GetCount() == static_cast<uint64_t>(index));
+			compactedMemoryManager.Free(&handles[index]);
+		}
+	}
+
+	// TEST 13: Iterate live objects of a type. Both forms visit the same objects in address order
+	{
+		MemoryManager iteratedMemoryManager(poolSize);
+		Dummy* dummies[1000];
+		for (int index = 0; index < poolSize; index++)
+		{
+			dummies[index] = new (iteratedMemoryManager.Allocate<Dummy>()) Dummy(index, 1.0);
+		}
+
+		for (int index = 0; index < poolSize; index += 3)
+		{
+			iteratedMemoryManager.Free(&dummies[index]);
+		}
+
+		uint64_t callbackSum = 0;
+		iteratedMemoryManager.ForEach<Dummy>([&](Dummy& dummy) { callbackSum += dummy.GetCount(); });
+
+		uint64_t rangeSum = 0;
+		const Dummy* previous = nullptr;
+		for (Dummy& dummy : iteratedMemoryManager.Live<Dummy>())
+		{
+			CHECK(&dummy > previous);
+			previous = &dummy;
+			rangeSum += dummy.GetCount();
+		}
+
+		uint64_t expectedSum = 0;
+		for (int index = 0; index < poolSize; index++)
+		{
+			expectedSum += (index % 3 != 0) ? index : 0;
+		}
+		CHECK(callbackSum == expectedSum && rangeSum == expectedSum);
+
+		iteratedMemoryManager.Reset();
+		CHECK(!(iteratedMemoryManager.Live<Dummy>().begin() != iteratedMemoryManager.Live<Dummy>().end()));
+	}
+
+	// TEST 14: Reuse policies. LIFO hands back the last freed block, the others the lowest one or one on the fullest page
+	{
+		MemoryManagerConfig config;
+		config.Parse("16 1024 backing=heap max=1024 reuse=lowest");
+		CHECK(config.mSizeClasses[0].mReusePolicy == ReusePolicy::LowestAddress);
+
+		MemoryManager lowestMemoryManager(config);
+		Dummy* dummies[1024];
+		for (int index = 0; index < 600; index++)
+		{
+			dummies[index] = lowestMemoryManager.Allocate<Dummy>();
+		}
+
+		Dummy* first = dummies[0];
+		lowestMemoryManager.Free(&dummies[500]);
+		lowestMemoryManager.Free(&dummies[5]);
+		lowestMemoryManager.Free(&dummies[70]);
+		Dummy* reused[4];
+		for (Dummy*& dummy : reused)
+		{
+			dummy = lowestMemoryManager.Allocate<Dummy>();
+		}
+		CHECK(reused[0] == first + 5 && reused[1] == first + 70 && reused[2] == first + 500 && reused[3] == first + 600);
+		lowestMemoryManager.SetLeakReporting(false);
+
+		// 256 blocks of 16 bytes per page: page 0 gets 10 free blocks, page 1 only 3, so page 1 is refilled first
+		config.mSizeClasses[0].mReusePolicy = ReusePolicy::FullestPage;
+		MemoryManager fullestMemoryManager(config);
+		for (int index = 0; index < 600; index++)
+		{
+			dummies[index] = fullestMemoryManager.Allocate<Dummy>();
+		}
+
+		first = dummies[0];
+		for (int index = 0; index < 10; index++)
+		{
+			fullestMemoryManager.Free(&dummies[index * 20]);
+		}
+		for (int index = 0; index < 3; index++)
+		{
+			fullestMemoryManager.Free(&dummies[256 + index * 50]);
+		}
+
+		for (int index = 0; index < 3; index++)
+		{
+			Dummy* dummy = fullestMemoryManager.Allocate<Dummy>();
+			CHECK(dummy >= first + 256 && dummy < first + 512);
+		}
+		Dummy* fromEmptierPage = fullestMemoryManager.Allocate<Dummy>();
+		CHECK(fromEmptierPage < first + 256);
+		fullestMemoryManager.SetLeakReporting(false);
+	}
+
+	// TEST 15: Slab layout. 4 KiB slabs each carry their own header; once all but a few blocks are freed, the empty slabs go back to the OS
+	{
+		MemoryManagerConfig config;
+		config.Parse("16 1000 growth=linear backing=heap slab=4096");
+
+		MemoryManager slabMemoryManager(config);
+		size_t initialCapacity = slabMemoryManager.GetCapacity(sizeof(Dummy));
+		CHECK(initialCapacity >= 1000 && initialCapacity < 1000 + 256);
+
+		Dummy* dummies[3000];
+		for (int index = 0; index < 3000; index++)
+		{
+			dummies[index] = new (slabMemoryManager.Allocate<Dummy>()) Dummy(index, 0.0);
+		}
+		CHECK(slabMemoryManager.GetCapacity(sizeof(Dummy)) >= 3000);
+
+		// Blocks are found in their slab on free, and a pointer into no slab is still rejected
+		Dummy outsider;
+		Dummy* outsiderPointer = &outsider;
+		slabMemoryManager.Free(&outsiderPointer);
+		CHECK(outsiderPointer != nullptr);
+
+		for (int index = 0; index < 3000; index++)
+		{
+			if (index % 1000 != 0)
+			{
+				slabMemoryManager.Free(&dummies[index]);
+			}
+		}
+
+		// 3 slabs hold the survivors, plus the active slab and one spare at most
+		CHECK(slabMemoryManager.GetCapacity(sizeof(Dummy)) <= 5 * 256);
+		CHECK(slabMemoryManager.CountLive(sizeof(Dummy)) == 3);
+		CHECK(dummies[1000]->GetCount() == 1000);
+
+		for (int index = 0; index < 3000; index += 1000)
+		{
+			slabMemoryManager.Free(&dummies[index]);
+		}
+
+		// With their pages tracked, mapped slabs are found without a lock, and no longer once released
+		config.Parse("16 1000 growth=linear backing=mmap slab=4096");
+		config.mTrackMappedPages = true;
+		MemoryManager mappedMemoryManager(config);
+
+		void* blocks[3000];
+		for (int index = 0; index < 3000; index++)
+		{
+			blocks[index] = mappedMemoryManager.Allocate(sizeof(Dummy));
+			CHECK(mappedMemoryManager.FindMappedBlockSize(blocks[index]) == sizeof(Dummy));
+		}
+		CHECK(mappedMemoryManager.FindMappedBlockSize(&outsider) == 0);
+
+		for (int index = 1; index < 3000; index++)
+		{
+			mappedMemoryManager.Free(blocks[index], sizeof(Dummy));
+		}
+
+		int foundBlocks = 0;
+		for (int index = 0; index < 3000; index++)
+		{
+			foundBlocks += mappedMemoryManager.FindMappedBlockSize(blocks[index]) != 0;
+		}
+		CHECK(foundBlocks <= 3 * 256 && mappedMemoryManager.FindMappedBlockSize(blocks[0]) == sizeof(Dummy));
+
+		mappedMemoryManager.Free(blocks[0], sizeof(Dummy));
+	}
+
+	// TEST 16: Per-CPU caches. Threads allocate and free concurrently through their CPU's magazine; once flushed, every block is back in its pool
+	{
+		MemoryManagerConfig config;
+		config.Parse("16 1024 growth=linear; 64 256 growth=linear; default 16 growth=linear");
+
+		PerCpuMemoryManager perCpuMemoryManager(config, 16);
+		printf("\nPer-CPU caches in use = %s", perCpuMemoryManager.UsesPerCpuCaches() ? "true" : "false");
+
+		std::vector<std::thread> threads;
+		for (int threadIndex = 0; threadIndex < 4; threadIndex++)
+		{
+			threads.emplace_back([&perCpuMemoryManager, threadIndex]()
+				{
+					Dummy* dummies[100];
+					for (int round = 0; round < 200; round++)
+					{
+						for (int index = 0; index < 100; index++)
+						{
+							dummies[index] = new (perCpuMemoryManager.Allocate<Dummy>()) Dummy(threadIndex * 100 + index, 0.0);
+						}
+
+						for (int index = 0; index < 100; index++)
+						{
+							CHECK(dummies[index]->GetCount() == static_cast<uint64_t>(threadIndex * 100 + index));
+							perCpuMemoryManager.Free(&dummies[index]);
+							CHECK(dummies[index] == nullptr);
+						}
+					}
+
+					// Size above every class, served from an on-demand pool by the locked pools
+					void* large = perCpuMemoryManager.Allocate(128);
+					CHECK(large != nullptr);
+					perCpuMemoryManager.Free(large, 128);
+				});
+		}
+
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+
+		perCpuMemoryManager.Flush();
+		CHECK(perCpuMemoryManager.CountLive(sizeof(Dummy)) == 0);
+	}
+
+	// TEST 17: Class-level pooling. PooledDummy only adds the Pooled base to Dummy; objects freed by another thread reach the pool
+	// through that thread's cache once it exits
+	{
+		PooledDummy* pooledDummies[100];
+		for (int index = 0; index < 100; index++)
+		{
+			pooledDummies[index] = new PooledDummy(index, 0.5);
+		}
+
+		CHECK(sizeof(PooledDummy) == sizeof(Dummy));
+		CHECK(PooledDummy::CountLive() >= 100);
+		CHECK(pooledDummies[99]->GetCount() == 99);
+
+		std::thread deletingThread([&pooledDummies]()
+			{
+				for (PooledDummy* pooledDummy : pooledDummies)
+				{
+					delete pooledDummy;
+				}
+			});
+		deletingThread.join();
+
+		// Only the blocks this thread still caches are out of the pool
+		CHECK(PooledDummy::CountLive() <= POOLED_CACHE_CAPACITY);
+
+		PooledDummy* nothrowDummy = new (std::nothrow) PooledDummy(7, 1.0);
+		CHECK(nothrowDummy && nothrowDummy->GetCount() == 7);
+		delete nothrowDummy;
+
+		// Placement new is unaffected
+		alignas(PooledDummy) char storage[sizeof(PooledDummy)];
+		PooledDummy* placedDummy = new (storage) PooledDummy(8, 1.0);
+		CHECK(reinterpret_cast<char*>(placedDummy) == storage);
+	}
+
+	// TEST 18: Reallocate. Growing within the size class keeps the block; crossing into another class moves the contents
+	{
+		MemoryManager resizedMemoryManager(10);
+		char* buffer = static_cast<char*>(resizedMemoryManager.Allocate(10));
+		memcpy(buffer, "pooled", 7);
+
+		char* grownBuffer = static_cast<char*>(resizedMemoryManager.Reallocate(buffer, 10, 16));
+		CHECK(grownBuffer == buffer);
+
+		char* movedBuffer = static_cast<char*>(resizedMemoryManager.Reallocate(grownBuffer, 16, 32));
+		CHECK(movedBuffer != grownBuffer && strcmp(movedBuffer, "pooled") == 0);
+		CHECK(resizedMemoryManager.CountLive(16) == 0 && resizedMemoryManager.CountLive(32) == 1);
+
+		// Shrinking into a smaller class moves too, so the block can later be freed with its new size
+		char* shrunkBuffer = static_cast<char*>(resizedMemoryManager.Reallocate(movedBuffer, 32, 8));
+		CHECK(strcmp(shrunkBuffer, "pooled") == 0 && resizedMemoryManager.CountLive(8) == 1);
+		CHECK(resizedMemoryManager.CountLive(32) == 0);
+		bool freed = resizedMemoryManager.Free(shrunkBuffer, 8);
+		CHECK(freed);
+	}
+
+	// TEST 19: Exhaustion policies. Each pool holds 2 blocks and may not grow; the third allocation is where the policies differ
+	{
+		MemoryManagerConfig config;
+		config.Parse("16 2 backing=heap max=2 exhausted=upstream; 32 2 backing=heap max=2 exhausted=grow; 64 2 backing=heap max=2 exhausted=throw; "
+			"128 2 backing=heap max=2 exhausted=handler");
+		MemoryManager exhaustedMemoryManager(config);
+
+		// Upstream: the extra block comes from malloc() and Free() sends it back there
+		void* upstreamBlocks[3];
+		for (void*& block : upstreamBlocks)
+		{
+			block = exhaustedMemoryManager.Allocate(16);
+			CHECK(block != nullptr);
+		}
+		CHECK(exhaustedMemoryManager.CountLive(16) == 2);
+		for (void* block : upstreamBlocks)
+		{
+			bool freed = exhaustedMemoryManager.Free(block, 16);
+			CHECK(freed);
+		}
+		bool freedTwice = exhaustedMemoryManager.Free(upstreamBlocks[2], 16);
+		CHECK(!freedTwice);
+
+		// Grow: one more chunk despite the limit
+		void* grownBlocks[3];
+		for (void*& block : grownBlocks)
+		{
+			block = exhaustedMemoryManager.Allocate(32);
+			CHECK(block != nullptr);
+		}
+		CHECK(exhaustedMemoryManager.GetCapacity(32) == 4);
+
+		// Throw
+		void* thrownBlocks[2] = { exhaustedMemoryManager.Allocate(64), exhaustedMemoryManager.Allocate(64) };
+		CHECK(thrownBlocks[0] && thrownBlocks[1]);
+		bool thrown = false;
+		try
+		{
+			exhaustedMemoryManager.Allocate(64);
+		}
+		catch (const std::bad_alloc&)
+		{
+			thrown = true;
+		}
+		CHECK(thrown);
+
+		// Handler: the first call frees a block to make room, the second gives up
+		void* handledBlocks[2] = { exhaustedMemoryManager.Allocate(128), exhaustedMemoryManager.Allocate(128) };
+		int handlerCalls = 0;
+		exhaustedMemoryManager.SetExhaustionHandler([&](size_t sizeClass)
+			{
+				CHECK(sizeClass == 128);
+				if (handlerCalls++ == 0)
+				{
+					exhaustedMemoryManager.Free(handledBlocks[0], 128);
+					return true;
+				}
+				return false;
+			});
+		void* handledBlock = exhaustedMemoryManager.Allocate(128);
+		CHECK(handledBlock == handledBlocks[0] && handlerCalls == 1);
+		void* unhandledBlock = exhaustedMemoryManager.Allocate(128);
+		CHECK(unhandledBlock == nullptr && handlerCalls == 2);
+
+		// TryAllocate() skips the policy: neither the throw nor the handler
+		void* triedBlocks[2] = { exhaustedMemoryManager.TryAllocate(64), exhaustedMemoryManager.TryAllocate(128) };
+		CHECK(triedBlocks[0] == nullptr && triedBlocks[1] == nullptr && handlerCalls == 2);
+
+		for (void* block : grownBlocks)
+		{
+			bool freed = exhaustedMemoryManager.Free(block, 32);
+			CHECK(freed);
+		}
+		for (void* block : thrownBlocks)
+		{
+			bool freed = exhaustedMemoryManager.Free(block, 64);
+			CHECK(freed);
+		}
+		bool freedHandled[2] = { exhaustedMemoryManager.Free(handledBlock, 128), exhaustedMemoryManager.Free(handledBlocks[1], 128) };
+		CHECK(freedHandled[0] && freedHandled[1]);
+		CHECK(exhaustedMemoryManager.CountLive(32) == 0 && exhaustedMemoryManager.CountLive(64) == 0 && exhaustedMemoryManager.CountLive(128) == 0);
+	}
+
+	// TEST 20: Budget and quotas. 16-byte blocks may take 32 bytes, all pools together 64
+	{
+		MemoryManagerConfig config;
+		config.Parse("budget 64; 16 8 backing=heap quota=32; 32 8");
+		CHECK(config.mBudgetBytes == 64 && config.mSizeClasses[0].mQuotaBytes == 32);
+		MemoryManager budgetMemoryManager(config);
+
+		void* smallBlocks[2] = { budgetMemoryManager.Allocate(16), budgetMemoryManager.Allocate(16) };
+		CHECK(smallBlocks[0] && smallBlocks[1]);
+		void* overQuotaBlock = budgetMemoryManager.TryAllocate(16);
+		CHECK(overQuotaBlock == nullptr && budgetMemoryManager.GetUsedBytes(16) == 32);
+
+		void* largeBlock = budgetMemoryManager.Allocate(32);
+		CHECK(largeBlock && budgetMemoryManager.GetUsedBytes() == 64);
+		void* overBudgetBlock = budgetMemoryManager.TryAllocate(32);
+		CHECK(overBudgetBlock == nullptr);
+
+		// Nobody frees: the wait times out
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		void* timedOutBlock = budgetMemoryManager.Allocate(32, std::chrono::milliseconds(20));
+		CHECK(timedOutBlock == nullptr && std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+
+		// Another thread frees the large block while the owner waits for room
+		std::thread freeingThread([&]()
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+				budgetMemoryManager.Free(largeBlock, 32);
+			});
+		void* waitedBlock = budgetMemoryManager.Allocate(32, std::chrono::seconds(10));
+		freeingThread.join();
+		CHECK(waitedBlock == largeBlock && budgetMemoryManager.GetUsedBytes() == 64);
+
+		// Raising the budget lets the pools fill up to their quotas
+		budgetMemoryManager.SetBudget(0);
+		void* withinQuotaBlock = budgetMemoryManager.TryAllocate(32);
+		overQuotaBlock = budgetMemoryManager.TryAllocate(16);
+		CHECK(withinQuotaBlock != nullptr && overQuotaBlock == nullptr);
+
+		bool quotaRemoved = budgetMemoryManager.SetQuota(16, 0);
+		void* unlimitedBlock = budgetMemoryManager.TryAllocate(16);
+		CHECK(quotaRemoved && unlimitedBlock != nullptr);
+
+		budgetMemoryManager.Reset();
+		CHECK(budgetMemoryManager.GetUsedBytes() == 0);
+	}
+
+	// TEST 21: Tagged views share the pools of one manager but count, and cap, their own allocations
+	{
+		MemoryManager taggedMemoryManager(MemoryManagerConfig::Default(16));
+		TaggedMemoryManager renderMemory(taggedMemoryManager, "render");
+		TaggedMemoryManager audioMemory(taggedMemoryManager, "audio", 32);
+
+		Dummy* renderDummies[3];
+		for (Dummy*& dummy : renderDummies)
+		{
+			dummy = renderMemory.Allocate<Dummy>();
+			CHECK(dummy != nullptr);
+		}
+
+		void* audioBlocks[2] = { audioMemory.Allocate(8), audioMemory.Allocate(16) };
+		CHECK(audioBlocks[0] && audioBlocks[1]);
+		void* overQuotaBlock = audioMemory.Allocate(16);
+		CHECK(overQuotaBlock == nullptr);
+		CHECK(renderMemory.GetLiveBytes() == 48 && audioMemory.GetLiveBytes() == 24);
+		CHECK(taggedMemoryManager.GetUsedBytes() == 72 && taggedMemoryManager.CountLive(16) == 4);
+
+		// Frees from other threads count as soon as they are queued
+		std::thread([&]() { renderMemory.Free(&renderDummies[0]); }).join();
+		CHECK(renderMemory.GetLiveBytes() == 32);
+
+		std::vector<MemoryTagStats> tagStats = taggedMemoryManager.GetTagStats();
+		CHECK(tagStats.size() == 2 && strcmp(tagStats[0].mTag, "render") == 0);
+		CHECK(tagStats[0].mAllocatedBytes == 48 && tagStats[0].mFreedBytes == 16);
+		CHECK(tagStats[1].mLiveBytes == 24 && tagStats[1].mQuotaBytes == 32);
+
+		{
+			TaggedMemoryManager scratchMemory(taggedMemoryManager, "scratch");
+			CHECK(taggedMemoryManager.GetTagStats().size() == 3);
+		}
+		CHECK(taggedMemoryManager.GetTagStats().size() == 2);
+
+		renderMemory.Free(&renderDummies[1]);
+		renderMemory.Free(&renderDummies[2]);
+		audioMemory.Free(audioBlocks[0], 8);
+		audioMemory.Free(audioBlocks[1], 16);
+		taggedMemoryManager.DrainRemoteFrees();
+		CHECK(taggedMemoryManager.GetUsedBytes() == 0 && renderMemory.GetLiveBytes() == 0 && audioMemory.GetLiveBytes() == 0);
+	}
+
+	// TEST 22: Random reuse hands out every block exactly once, in an order that is neither sequential nor the same from one pool to the next
+	{
+		MemoryManagerConfig config;
+		config.Parse("16 1000 backing=heap reuse=random");
+		CHECK(config.mSizeClasses[0].mReusePolicy == ReusePolicy::Random);
+
+		MemoryManager firstRandomMemoryManager(config);
+		MemoryManager secondRandomMemoryManager(config);
+		Dummy* firstOrder[1000];
+		Dummy* secondOrder[1000];
+		for (int index = 0; index < 1000; index++)
+		{
+			firstOrder[index] = firstRandomMemoryManager.Allocate<Dummy>();
+			secondOrder[index] = secondRandomMemoryManager.Allocate<Dummy>();
+			CHECK(firstOrder[index] && secondOrder[index]);
+		}
+		Dummy* overflowDummy = firstRandomMemoryManager.Allocate<Dummy>();
+		CHECK(overflowDummy == nullptr);
+
+		std::vector<Dummy*> sortedBlocks(firstOrder, firstOrder + 1000);
+		std::sort(sortedBlocks.begin(), sortedBlocks.end());
+		CHECK(std::unique(sortedBlocks.begin(), sortedBlocks.end()) == sortedBlocks.end());
+		CHECK(sortedBlocks.back() - sortedBlocks.front() == 999);
+
+		size_t numSequential = 0;
+		size_t numSameOffset = 0;
+		for (int index = 1; index < 1000; index++)
+		{
+			numSequential += (firstOrder[index] == firstOrder[index - 1] + 1);
+			numSameOffset += (firstOrder[index] - firstOrder[0] == secondOrder[index] - secondOrder[0]);
+		}
+		CHECK(numSequential < 100 && numSameOffset < 100);
+
+		// Freed blocks come back in random order too, and a reset scatters the pool again
+		Dummy* freed = firstOrder[500];
+		firstRandomMemoryManager.Free(&firstOrder[500]);
+		Dummy* reallocated = firstRandomMemoryManager.Allocate<Dummy>();
+		CHECK(reallocated == freed);
+		firstRandomMemoryManager.Reset();
+		CHECK(firstRandomMemoryManager.CountLive(16) == 0);
+		Dummy* afterReset = firstRandomMemoryManager.Allocate<Dummy>();
+		CHECK(afterReset != nullptr);
+		firstRandomMemoryManager.SetLeakReporting(false);
+		secondRandomMemoryManager.SetLeakReporting(false);
+	}
+
+#if defined(__linux__)
+	// TEST 23: realloc() keeps the contents of large blocks as they grow and shrink. Run with the malloc replacement preloaded
+	// (LD_PRELOAD=./libpoolmalloc.so), that goes through mremap(), and a block resized within its size class stays where it is
+	{
+		Dl_info mallocInfo;
+		bool poolMallocPreloaded = dladdr(dlsym(RTLD_DEFAULT, "malloc"), &mallocInfo) && mallocInfo.dli_fname && strstr(mallocInfo.dli_fname, "libpoolmalloc");
+
+		const size_t largeBytes = 1024 * 1024;
+		unsigned char* largeBlock = static_cast<unsigned char*>(malloc(largeBytes));
+		CHECK(largeBlock != nullptr);
+		for (size_t index = 0; index < largeBytes; index++)
+		{
+			largeBlock[index] = static_cast<unsigned char>(index * 7);
+		}
+
+		largeBlock = static_cast<unsigned char*>(realloc(largeBlock, 8 * largeBytes));
+		CHECK(largeBlock != nullptr);
+		bool keptContents = true;
+		for (size_t index = 0; index < largeBytes; index++)
+		{
+			keptContents = keptContents && largeBlock[index] == static_cast<unsigned char>(index * 7);
+		}
+		memset(largeBlock + largeBytes, 0xAB, 7 * largeBytes);
+
+		largeBlock = static_cast<unsigned char*>(realloc(largeBlock, largeBytes / 4));
+		CHECK(largeBlock != nullptr);
+		for (size_t index = 0; index < largeBytes / 4; index++)
+		{
+			keptContents = keptContents && largeBlock[index] == static_cast<unsigned char>(index * 7);
+		}
+		CHECK(keptContents);
+		free(largeBlock);
+
+		// 20 and 30 bytes share the 32-byte size class of the replacement
+		char* smallBlock = static_cast<char*>(malloc(20));
+		strcpy(smallBlock, "in place");
+		char* resizedBlock = static_cast<char*>(realloc(smallBlock, 30));
+		CHECK(resizedBlock != nullptr && strcmp(resizedBlock, "in place") == 0);
+		CHECK(!poolMallocPreloaded || resizedBlock == smallBlock);
+		free(resizedBlock);
+
+		printf("\nrealloc() checks passed%s\n", poolMallocPreloaded ? " with the malloc replacement preloaded" : "");
+	}
+#endif // __linux__
+
 #ifndef _DEBUG
 	poolSize = 1000;
 	delete memoryManager;
@@ -115,5 +1044,424 @@ int main()
 
 	printf("\nTime taken without = %lf", static_cast<double>(endTime - startTime) / CLOCKS_PER_SEC);
 
+	PooledDummy* pooledPtr[1000];
+	startTime = clock();
+
+	for (int index = 0; index < poolSize; index++)
+	{
+		pooledPtr[index] = new PooledDummy();
+	}
+
+	for (int index = 0; index < poolSize; index++)
+	{
+		delete pooledPtr[index];
+	}
+
+	endTime = clock();
+
+	printf("\nTime taken with new / delete of a Pooled type = %lf", static_cast<double>(endTime - startTime) / CLOCKS_PER_SEC);
+
+	// Pools are created without touching their blocks, so this should not scale with the block count
+	startTime = clock();
+
+	MemoryManager* largeMemoryManager = new MemoryManager(1000000);
+
+	endTime = clock();
+
+	printf("\nTime taken to create pools of 1M blocks = %lf", static_cast<double>(endTime - startTime) / CLOCKS_PER_SEC);
+
+	delete largeMemoryManager;
+
+	// Per-tick update of every live object: pool iteration against a separate vector of pointers
+	{
+		const int numObjects = 1000000;
+		MemoryManager iteratedMemoryManager(numObjects);
+		std::vector<Dummy*> pointers;
+		for (int index = 0; index < numObjects; index++)
+		{
+			pointers.push_back(new (iteratedMemoryManager.Allocate<Dummy>()) Dummy(index, 1.0));
+		}
+
+		// Every other object dies, as after a few frames of churn
+		for (int index = 0; index < numObjects; index += 2)
+		{
+			iteratedMemoryManager.Free(&pointers[index]);
+		}
+		pointers.erase(std::remove(pointers.begin(), pointers.end(), nullptr), pointers.end());
+
+		uint64_t sum = 0;
+		startTime = clock();
+		for (Dummy& dummy : iteratedMemoryManager.Live<Dummy>())
+		{
+			sum += dummy.GetCount();
+		}
+		endTime = clock();
+		printf("\nTime taken to iterate 500K live objects in the pool = %lf", static_cast<double>(endTime - startTime) / CLOCKS_PER_SEC);
+
+		startTime = clock();
+		for (Dummy* dummy : pointers)
+		{
+			sum -= dummy->GetCount();
+		}
+		endTime = clock();
+		printf("\nTime taken to iterate them through a pointer vector = %lf", static_cast<double>(endTime - startTime) / CLOCKS_PER_SEC);
+		CHECK(sum == 0);
+	}
+
+	// Owner allocating and freeing while another thread queues remote frees into the same pool. With MM_PAD_METADATA the remote free list head
+	// and the chunk headers sit on cache lines of their own, so the owner should take about as many L1 misses per operation with the other thread
+	// busy as without. Build with -DMM_PAD_METADATA=0 for the unpadded baseline, where the busy thread's pushes add misses
+	int probeCounter = OpenL1MissCounter();
+	if (probeCounter < 0)
+	{
+		printf("\nSkipping the remote free benchmark: L1D miss counters cannot be opened (no perf events here)");
+	}
+	else
+	{
+		ClosePerfCounter(probeCounter);
+
+		const size_t numRemoteBlocks = 4000000;
+		MemoryManager contendedMemoryManager(numRemoteBlocks + 16);
+		std::vector<Dummy*> remoteBlocks(numRemoteBlocks);
+
+		for (int busy = 0; busy < 2; busy++)
+		{
+			for (size_t index = 0; index < numRemoteBlocks; index++)
+			{
+				remoteBlocks[index] = contendedMemoryManager.Allocate<Dummy>();
+			}
+
+			std::atomic<bool> started{ false };
+			std::atomic<bool> finished{ false };
+			std::thread freeingThread([&]()
+				{
+					while (!started.load(std::memory_order_acquire)) {}
+					if (busy)
+					{
+						for (Dummy*& block : remoteBlocks)
+						{
+							contendedMemoryManager.Free(&block);
+						}
+					}
+					else
+					{
+						std::this_thread::sleep_for(std::chrono::milliseconds(100));
+					}
+					finished.store(true, std::memory_order_release);
+				});
+
+			int missCounter = OpenL1MissCounter();
+			started.store(true, std::memory_order_release);
+
+			// Wall-clock time: clock() would add up the CPU time of both threads
+			size_t operations = 0;
+			auto pairsStart = std::chrono::steady_clock::now();
+			while (!finished.load(std::memory_order_acquire))
+			{
+				Dummy* dummy = contendedMemoryManager.Allocate<Dummy>();
+				contendedMemoryManager.Free(&dummy);
+				operations++;
+			}
+			double pairsTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - pairsStart).count();
+
+			long long misses = ClosePerfCounter(missCounter);
+			freeingThread.join();
+
+			if (!busy)
+			{
+				// Nothing was queued; hand the blocks back directly
+				for (Dummy*& block : remoteBlocks)
+				{
+					contendedMemoryManager.Free(&block);
+				}
+			}
+			contendedMemoryManager.DrainRemoteFrees();
+
+			printf("\nOwner alloc/free pairs with the other thread %s, %s metadata: %zu in %lf s, ", busy ? "freeing remotely" : "idle",
+				MM_PAD_METADATA ? "padded" : "unpadded", operations, pairsTime);
+			if (misses >= 0)
+			{
+				printf("L1D misses per pair = %lf", static_cast<double>(misses) / operations);
+			}
+			else
+			{
+				printf("L1D miss counter could not be read");
+			}
+		}
+	}
+
+	// Long random churn under each reuse policy. Once the live set has shrunk and regrown, count the pages the objects allocated last are spread over
+	// (their share of the resident set) and time a pass over them in allocation order
+	{
+		const char* policyNames[] = { "LIFO", "lowest address", "fullest page", "random" };
+		ReusePolicy policies[] = { ReusePolicy::Lifo, ReusePolicy::LowestAddress, ReusePolicy::FullestPage, ReusePolicy::Random };
+		const int numObjects = 1000000;
+
+		for (int policyIndex = 0; policyIndex < 4; policyIndex++)
+		{
+			MemoryManagerConfig config;
+			config.Parse("16 1000000 backing=mmap");
+			config.mSizeClasses[0].mReusePolicy = policies[policyIndex];
+
+			MemoryManager churnedMemoryManager(config);
+			std::vector<Dummy*> live;
+			srand(1);
+
+			startTime = clock();
+			for (int round = 0; round < 4; round++)
+			{
+				while (live.size() < numObjects * 9 / 10)
+				{
+					live.push_back(new (churnedMemoryManager.Allocate<Dummy>()) Dummy(live.size(), 1.0));
+				}
+
+				while (live.size() > numObjects / 10)
+				{
+					size_t victim = (static_cast<size_t>(rand()) * RAND_MAX + rand()) % live.size();
+					churnedMemoryManager.Free(&live[victim]);
+					live[victim] = live.back();
+					live.pop_back();
+				}
+			}
+
+			size_t firstRecent = live.size();
+			while (live.size() < numObjects / 2)
+			{
+				live.push_back(new (churnedMemoryManager.Allocate<Dummy>()) Dummy(live.size(), 1.0));
+			}
+			endTime = clock();
+			double churnTime = static_cast<double>(endTime - startTime) / CLOCKS_PER_SEC;
+
+			std::vector<uintptr_t> pages;
+			for (size_t index = firstRecent; index < live.size(); index++)
+			{
+				pages.push_back(reinterpret_cast<uintptr_t>(live[index]) / OS_PAGE_SIZE);
+			}
+			std::sort(pages.begin(), pages.end());
+			size_t numPages = std::unique(pages.begin(), pages.end()) - pages.begin();
+
+			volatile uint64_t sum = 0;
+			startTime = clock();
+			for (size_t index = firstRecent; index < live.size(); index++)
+			{
+				sum = sum + live[index]->GetCount();
+			}
+			endTime = clock();
+
+			printf("\nReuse policy %s: churn = %lf, pages holding the 400K newest objects = %zu, iterating them in allocation order = %lf",
+				policyNames[policyIndex], churnTime, numPages, static_cast<double>(endTime - startTime) / CLOCKS_PER_SEC);
+		}
+	}
+
+	// Alloc/free pairs through the per-CPU magazines against the same pools behind a lock
+	{
+		const int numPairs = 10000000;
+		for (int perCpu = 1; perCpu >= 0; perCpu--)
+		{
+			PerCpuMemoryManager pairedMemoryManager(MemoryManagerConfig::Default(1024), DEFAULT_MAGAZINE_CAPACITY, perCpu != 0);
+
+			startTime = clock();
+			for (int index = 0; index < numPairs; index++)
+			{
+				Dummy* dummy = pairedMemoryManager.Allocate<Dummy>();
+				pairedMemoryManager.Free(&dummy);
+			}
+			endTime = clock();
+
+			printf("\nTime taken for 10M alloc/free pairs %s = %lf", pairedMemoryManager.UsesPerCpuCaches() ? "through per-CPU caches" : "under a lock",
+				static_cast<double>(endTime - startTime) / CLOCKS_PER_SEC);
+		}
+	}
+
+	// Alloc/free pairs through a tagged view against the manager it views
+	{
+		const int numPairs = 10000000;
+		MemoryManager pairedMemoryManager(MemoryManagerConfig::Default(1024));
+		TaggedMemoryManager taggedMemoryManager(pairedMemoryManager, "benchmark");
+
+		startTime = clock();
+		for (int index = 0; index < numPairs; index++)
+		{
+			Dummy* dummy = pairedMemoryManager.Allocate<Dummy>();
+			pairedMemoryManager.Free(&dummy);
+		}
+		endTime = clock();
+		printf("\nTime taken for 10M alloc/free pairs without a tag = %lf", static_cast<double>(endTime - startTime) / CLOCKS_PER_SEC);
+
+		startTime = clock();
+		for (int index = 0; index < numPairs; index++)
+		{
+			Dummy* dummy = taggedMemoryManager.Allocate<Dummy>();
+			taggedMemoryManager.Free(&dummy);
+		}
+		endTime = clock();
+		printf("\nTime taken for 10M alloc/free pairs through a tag = %lf", static_cast<double>(endTime - startTime) / CLOCKS_PER_SEC);
+	}
+
+	// Allocation off a free list in random order, as left behind by objects freed in no particular order. The pool is far larger than the cache
+	// and consecutive free blocks lie far apart, so following the list misses on every pop unless the next block was prefetched
+	{
+		const size_t numScattered = 1 << 21;
+		MemoryManager scatteredMemoryManager{ MemoryManagerConfig() };
+		scatteredMemoryManager.InitializePool(sizeof(Dummy), numScattered);
+
+		std::vector<Dummy*> scattered(numScattered);
+		for (Dummy*& dummy : scattered)
+		{
+			dummy = scatteredMemoryManager.Allocate<Dummy>();
+		}
+
+		std::shuffle(scattered.begin(), scattered.end(), std::mt19937(12345));
+		for (Dummy*& dummy : scattered)
+		{
+			scatteredMemoryManager.Free(&dummy);
+		}
+
+		startTime = clock();
+		for (Dummy*& dummy : scattered)
+		{
+			dummy = new (scatteredMemoryManager.Allocate<Dummy>()) Dummy(1, 2.0);
+		}
+		endTime = clock();
+
+		printf("\nTime per allocation off a shuffled free list, prefetch %s = %lf ns", MM_PREFETCH_FREE_LIST ? "on" : "off",
+			static_cast<double>(endTime - startTime) / CLOCKS_PER_SEC * 1e9 / numScattered);
+		scatteredMemoryManager.Reset();
+	}
+
+#if UINTPTR_MAX > 0xFFFFFFFF
+	// TEST 24: Pool larger than 4 GiB. Only the first page of each block gets touched
+	{
+		const size_t numLargeBlocks = 70000;
+		MemoryManager hugeMemoryManager(1);
+
+		bool created = hugeMemoryManager.InitializePool(sizeof(LargeRecord), numLargeBlocks);
+		printf("\nCreated pool of %zu bytes = %s", sizeof(LargeRecord) * numLargeBlocks, created ? "true" : "false");
+
+		if (created)
+		{
+			LargeRecord* firstRecord = hugeMemoryManager.Allocate<LargeRecord>();
+			LargeRecord* lastRecord = firstRecord;
+			size_t allocatedCount = 1;
+			while (LargeRecord* record = hugeMemoryManager.Allocate<LargeRecord>())
+			{
+				lastRecord = record;
+				allocatedCount++;
+			}
+
+			// Release builds only, where assert() is compiled out
+			if (allocatedCount != numLargeBlocks || static_cast<size_t>(lastRecord - firstRecord) != numLargeBlocks - 1)
+			{
+				printf("\n[FAILURE] Allocated %zu of %zu blocks, %td records apart\n", allocatedCount, numLargeBlocks, lastRecord - firstRecord);
+				return 1;
+			}
+
+			hugeMemoryManager.Free(&lastRecord);
+			if (hugeMemoryManager.CountLive(sizeof(LargeRecord)) != numLargeBlocks - 1)
+			{
+				printf("\n[FAILURE] %zu blocks live after freeing one\n", hugeMemoryManager.CountLive(sizeof(LargeRecord)));
+				return 1;
+			}
+			hugeMemoryManager.Reset();
+		}
+
+		// Block count that would wrap the pool size around must be rejected
+		if (hugeMemoryManager.InitializePool(sizeof(LargeRecord) * 2, SIZE_MAX / sizeof(LargeRecord)))
+		{
+			printf("\n[FAILURE] Pool whose size wraps around was created\n");
+			return 1;
+		}
+	}
+#endif // UINTPTR_MAX > 0xFFFFFFFF
+
+#if defined(__linux__)
+	// TEST 25: Low-latency pools. A child process counts the page faults of a first pass over a lazy pool and over a locked one (pre-faulted
+	// only, if that is over the lock limit of the process), then enters seccomp strict mode, where any system call but read, write and exit
+	// kills it, and keeps allocating and freeing. Release builds only: debug builds log every allocation
+	{
+		fflush(stdout);
+		pid_t latencyProcess = fork();
+		if (latencyProcess == 0)
+		{
+			const size_t numLatencyBlocks = 16384;
+			std::vector<char*> latencyBlocks(numLatencyBlocks);
+
+			// Minor faults taken while allocating and writing every 64-byte block of the pool, then freeing them all
+			auto countFirstPassFaults = [&](MemoryManager& latencyMemoryManager)
+			{
+				rusage before;
+				getrusage(RUSAGE_SELF, &before);
+				for (char*& block : latencyBlocks)
+				{
+					block = static_cast<char*>(latencyMemoryManager.Allocate(64));
+					memset(block, 1, 64);
+				}
+				for (char* block : latencyBlocks)
+				{
+					latencyMemoryManager.Free(block, 64);
+				}
+				rusage after;
+				getrusage(RUSAGE_SELF, &after);
+				return after.ru_minflt - before.ru_minflt;
+			};
+
+			MemoryManagerConfig config;
+			config.Parse("64 16384 backing=mmap");
+			MemoryManager lazyMemoryManager(config);
+			long lazyFaults = countFirstPassFaults(lazyMemoryManager);
+
+			config.Parse("64 16384 backing=mmap fault=lock");
+			std::unique_ptr<MemoryManager> lowLatencyMemoryManager(new MemoryManager(config));
+			if (lowLatencyMemoryManager->GetCapacity(64) == 0)
+			{
+				config.mSizeClasses[0].mFaultPolicy = FaultPolicy::Prefault;
+				lowLatencyMemoryManager.reset(new MemoryManager(config));
+			}
+			long lowLatencyFaults = countFirstPassFaults(*lowLatencyMemoryManager);
+
+			printf("\nPage faults on a first pass over 1 MiB of blocks: lazy = %ld, %s = %ld", lazyFaults,
+				config.mSizeClasses[0].mFaultPolicy == FaultPolicy::Lock ? "locked" : "pre-faulted", lowLatencyFaults);
+			fflush(stdout);
+
+			if (lazyFaults < 256 || lowLatencyFaults != 0)
+			{
+				_exit(1);
+			}
+
+			if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_STRICT) != 0)
+			{
+				_exit(2);
+			}
+
+			for (int round = 0; round < 100; round++)
+			{
+				for (char*& block : latencyBlocks)
+				{
+					block = static_cast<char*>(lowLatencyMemoryManager->Allocate(64));
+				}
+				for (char* block : latencyBlocks)
+				{
+					lowLatencyMemoryManager->Free(block, 64);
+				}
+			}
+
+			// exit_group, which _exit() uses, is not allowed in strict mode
+			syscall(SYS_exit, 0);
+		}
+
+		// SIGKILL: the child made a system call after entering strict mode. Exit code 2: seccomp is not available, nothing to check
+		int latencyStatus = -1;
+		if (latencyProcess < 0 || waitpid(latencyProcess, &latencyStatus, 0) != latencyProcess
+			|| !WIFEXITED(latencyStatus) || (WEXITSTATUS(latencyStatus) != 0 && WEXITSTATUS(latencyStatus) != 2))
+		{
+			printf("\n[FAILURE] Low-latency pool check failed, child status %#x\n", latencyStatus);
+			return 1;
+		}
+	}
+#endif // __linux__
+
 #endif // !_DEBUG
+
+	// Blocks still held in ptr[] show up in the leak report (debug builds)
+	delete memoryManager;
 }
\ No newline at end of file
@@ -0,0 +1,513 @@
+/* =========================================================================================
+*
+*	Purpose:	malloc() family backed by Memory Manager pools, for LD_PRELOAD into unmodified binaries
+*	Author:		Sreyash (Srey) Raychaudhuri
+*	Date:		12/22/2024
+*
+*	Linux / glibc only, and not part of the Visual Studio build. Build as a release shared library:
+*
+*		g++ -std=c++17 -O2 -shared -fPIC -o libpoolmalloc.so MallocReplacement.cpp -pthread -ldl
+*		LD_PRELOAD=./libpoolmalloc.so /usr/bin/time -v <program>
+*
+*	TEST 23 of the test program checks realloc() when run under LD_PRELOAD like this
+*
+*	Requests up to MALLOC_MAX_POOLED_SIZE bytes come from slab-laid-out pools behind per-CPU caches; larger ones are mapped straight from the OS,
+*	and realloc() resizes their mapping with mremap() rather than copying.
+*	free() tells the two apart through lock-free page maps, so it only locks when a magazine overflows. Pointers it finds in neither
+*	(blocks glibc allocated itself) go back to glibc.
+*	_DEBUG must stay undefined: the debug traces of the Memory Manager would call back into malloc()
+*
+* ==========================================================================================
+*/
+
+// __GLIBC__ comes from the C library headers, so one of them has to be in before the check
+#if defined(__linux__)
+#include <features.h>
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && !defined(_DEBUG)
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <dlfcn.h>
+#include <new>
+#include <pthread.h>
+
+#include "PerCpuMemoryManager.h"
+
+// Largest request served from a pool
+#define MALLOC_MAX_POOLED_SIZE	8192
+
+// Slab size of every pool. Slabs left empty are unmapped, so the resident set follows the live set
+#define MALLOC_SLAB_BYTES		(64 * 1024)
+
+// Every pointer malloc() returns is aligned to this
+#define MALLOC_ALIGNMENT		16
+
+// The real allocator of glibc. Memory the Memory Manager allocates for its own bookkeeping (pool maps, chunk vectors) comes from here
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* block, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+extern "C" void __libc_free(void* block);
+
+namespace
+{
+	// Set while the calling thread is inside the Memory Manager: allocations it makes then are its own bookkeeping and go to glibc.
+	// Initial-exec, so reading it never allocates (a dynamic TLS access may, through __tls_get_addr)
+	__thread bool tInsideManager __attribute__((tls_model("initial-exec"))) = false;
+
+	// Manager constructed in place on first use, before any static constructor of the program may have run. Never destroyed,
+	// as blocks may still be freed after static destructors
+	alignas(PerCpuMemoryManager) char gManagerStorage[sizeof(PerCpuMemoryManager)];
+	PerCpuMemoryManager* gManager = nullptr;
+
+	// Page holding each large block handed out, set to 1. Constructed and kept like the manager
+	alignas(PageMap) char gLargeBlocksStorage[sizeof(PageMap)];
+	PageMap* gLargeBlocks = nullptr;
+
+	// 0 = not initialized, 1 = initializing, 2 = ready
+	std::atomic<int> gState{ 0 };
+
+	// malloc_usable_size() of glibc, looked up on first use
+	typedef size_t (*UsableSizeFunction)(void*);
+	std::atomic<UsableSizeFunction> gLibcUsableSize{ nullptr };
+
+	// Marks the calling thread as inside the Memory Manager for the scope
+	class ManagerScope
+	{
+	public:
+		ManagerScope() { tInsideManager = true; }
+		~ManagerScope() { tInsideManager = false; }
+	};
+
+	// Mapping behind a request larger than MALLOC_MAX_POOLED_SIZE, stored right before the pointer handed out
+	struct LargeHeader
+	{
+		void* mMapping;
+		size_t mBytes;
+	};
+
+	static_assert(sizeof(LargeHeader) == MALLOC_ALIGNMENT, "Large blocks must stay aligned like pooled ones");
+
+	void LockBeforeFork() { gManager->Lock(); }
+	void UnlockAfterFork() { gManager->Unlock(); }
+
+	bool IsInitialized() { return gState.load(std::memory_order_acquire) == 2; }
+
+	// Construct the manager on the first call from any thread. Other threads wait for it
+	void Initialize()
+	{
+		if (IsInitialized())
+		{
+			return;
+		}
+
+		int expected = 0;
+		if (gState.compare_exchange_strong(expected, 1, std::memory_order_acq_rel))
+		{
+			ManagerScope scope;
+
+			// Every slab is mapped, so that free() finds it in the page map of the manager rather than looking it up under the lock
+			MemoryManagerConfig config = MemoryManagerConfig::General(MALLOC_MAX_POOLED_SIZE, MALLOC_SLAB_BYTES);
+			for (SizeClassConfig& sizeClass : config.mSizeClasses)
+			{
+				sizeClass.mBacking = PoolBacking::Mmap;
+			}
+
+			config.mDefaults.mBacking = PoolBacking::Mmap;
+			config.mTrackMappedPages = true;
+
+			gLargeBlocks = new (gLargeBlocksStorage) PageMap();
+			gManager = new (gManagerStorage) PerCpuMemoryManager(config);
+			pthread_atfork(LockBeforeFork, UnlockAfterFork, UnlockAfterFork);
+			gState.store(2, std::memory_order_release);
+			return;
+		}
+
+		while (!IsInitialized())
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	void* AllocateLarge(size_t size, size_t alignment)
+	{
+		if (size > SIZE_MAX - alignment - sizeof(LargeHeader) - OS_PAGE_SIZE)
+		{
+			return nullptr;
+		}
+
+		// Room for the header before the block, and for moving the block up to the alignment. Mappings are page aligned already
+		size_t padding = (alignment > OS_PAGE_SIZE) ? alignment : 0;
+		size_t bytes = (sizeof(LargeHeader) + padding + size + OS_PAGE_SIZE - 1) / OS_PAGE_SIZE * OS_PAGE_SIZE;
+		char* mapping = reinterpret_cast<char*>(MapPages(bytes));
+		if (!mapping)
+		{
+			return nullptr;
+		}
+
+		uintptr_t address = reinterpret_cast<uintptr_t>(mapping) + sizeof(LargeHeader);
+		address = (address + alignment - 1) / alignment * alignment;
+
+		LargeHeader* header = reinterpret_cast<LargeHeader*>(address) - 1;
+		header->mMapping = mapping;
+		header->mBytes = bytes;
+		if (!gLargeBlocks->Set(header + 1, 1, 1))
+		{
+			UnmapPages(mapping, bytes);
+			return nullptr;
+		}
+
+		return reinterpret_cast<void*>(address);
+	}
+
+	LargeHeader* GetLargeHeader(void* block) { return reinterpret_cast<LargeHeader*>(block) - 1; }
+
+	bool IsLargeBlock(const void* block) { return gLargeBlocks->Get(block) != 0; }
+
+	// The page map entry goes first: once the pages are unmapped, another thread may map them and record a block of its own there
+	void FreeLarge(void* block)
+	{
+		LargeHeader* header = GetLargeHeader(block);
+		gLargeBlocks->Set(block, 1, 0);
+		UnmapPages(header->mMapping, header->mBytes);
+	}
+
+	// Resize the mapping behind a large block. Where it cannot grow in place the kernel moves its pages, so nothing is copied either way.
+	// nullptr (block left untouched) on failure
+	void* ReallocateLarge(void* block, size_t size)
+	{
+		LargeHeader* header = GetLargeHeader(block);
+		size_t offset = static_cast<size_t>(reinterpret_cast<char*>(block) - reinterpret_cast<char*>(header->mMapping));
+		if (size > SIZE_MAX - offset - OS_PAGE_SIZE)
+		{
+			return nullptr;
+		}
+
+		size_t bytes = (offset + size + OS_PAGE_SIZE - 1) / OS_PAGE_SIZE * OS_PAGE_SIZE;
+		if (mremap(header->mMapping, header->mBytes, bytes, 0) != MAP_FAILED)
+		{
+			header->mBytes = bytes;
+			return block;
+		}
+
+		// The pages move onto a mapping reserved first, so the new place of the block is recorded before it is used and a failure
+		// leaves the old block as it was. The old record is cleared before its pages are unmapped and could be handed to another thread
+		char* mapping = reinterpret_cast<char*>(MapPages(bytes));
+		if (!mapping)
+		{
+			return nullptr;
+		}
+
+		char* newBlock = mapping + offset;
+		if (!gLargeBlocks->Set(newBlock, 1, 1))
+		{
+			UnmapPages(mapping, bytes);
+			return nullptr;
+		}
+
+		gLargeBlocks->Set(block, 1, 0);
+		if (mremap(header->mMapping, header->mBytes, bytes, MREMAP_MAYMOVE | MREMAP_FIXED, mapping) == MAP_FAILED)
+		{
+			gLargeBlocks->Set(block, 1, 1);
+			gLargeBlocks->Set(newBlock, 1, 0);
+			UnmapPages(mapping, bytes);
+			return nullptr;
+		}
+
+		header = GetLargeHeader(newBlock);
+		header->mMapping = mapping;
+		header->mBytes = bytes;
+		return newBlock;
+	}
+
+	// Bytes usable at a large block
+	size_t GetLargeUsableSize(void* block)
+	{
+		LargeHeader* header = GetLargeHeader(block);
+		return static_cast<size_t>(reinterpret_cast<char*>(header->mMapping) + header->mBytes - reinterpret_cast<char*>(block));
+	}
+
+	// malloc_usable_size() of glibc, for blocks it allocated. dlsym() may allocate, so the calling thread counts as inside the manager meanwhile
+	size_t GetLibcUsableSize(void* block)
+	{
+		UsableSizeFunction usableSize = gLibcUsableSize.load(std::memory_order_acquire);
+		if (!usableSize)
+		{
+			bool insideManager = tInsideManager;
+			tInsideManager = true;
+			usableSize = reinterpret_cast<UsableSizeFunction>(dlsym(RTLD_NEXT, "malloc_usable_size"));
+			tInsideManager = insideManager;
+			gLibcUsableSize.store(usableSize, std::memory_order_release);
+		}
+
+		return usableSize ? usableSize(block) : 0;
+	}
+
+	// alignment must be a power of two
+	void* Allocate(size_t size, size_t alignment)
+	{
+		Initialize();
+
+		// Pooled blocks are aligned to their size up to a cache line: chunks start on one, and block sizes are multiples of 16
+		size_t pooledSize = std::max<size_t>(size, 1);
+		if (alignment > MALLOC_ALIGNMENT)
+		{
+			pooledSize = (alignment <= CACHE_LINE_SIZE) ? (pooledSize + alignment - 1) / alignment * alignment : SIZE_MAX;
+		}
+
+		void* block = nullptr;
+		if (pooledSize <= MALLOC_MAX_POOLED_SIZE)
+		{
+			ManagerScope scope;
+			block = gManager->Allocate(pooledSize);
+
+			// A size class that is not a multiple of the alignment (48 bytes for 32 byte alignment) takes the next one that is
+			while (block && reinterpret_cast<uintptr_t>(block) % alignment != 0)
+			{
+				size_t blockSize = gManager->FindMappedBlockSize(block);
+				gManager->Free(block, blockSize);
+				block = (blockSize + alignment <= MALLOC_MAX_POOLED_SIZE) ? gManager->Allocate((blockSize + alignment) / alignment * alignment) : nullptr;
+			}
+		}
+
+		if (!block)
+		{
+			block = AllocateLarge(size, std::max<size_t>(alignment, MALLOC_ALIGNMENT));
+		}
+
+		if (!block)
+		{
+			errno = ENOMEM;
+		}
+
+		return block;
+	}
+
+	void Free(void* block)
+	{
+		if (!block)
+		{
+			return;
+		}
+
+		// Nothing was handed out before initialization, so such a block is glibc's
+		size_t blockSize = IsInitialized() ? gManager->FindMappedBlockSize(block) : 0;
+		if (blockSize)
+		{
+			ManagerScope scope;
+			gManager->Free(block, blockSize);
+		}
+		else if (IsInitialized() && IsLargeBlock(block))
+		{
+			FreeLarge(block);
+		}
+		else
+		{
+			__libc_free(block);
+		}
+	}
+
+	// Bytes usable at block, whoever allocated it
+	size_t GetUsableSize(void* block)
+	{
+		size_t blockSize = IsInitialized() ? gManager->FindMappedBlockSize(block) : 0;
+		if (blockSize)
+		{
+			return blockSize;
+		}
+
+		return (IsInitialized() && IsLargeBlock(block)) ? GetLargeUsableSize(block) : GetLibcUsableSize(block);
+	}
+
+	bool IsValidAlignment(size_t alignment) { return alignment && (alignment & (alignment - 1)) == 0; }
+}
+
+
+extern "C" void* malloc(size_t size)
+{
+	if (tInsideManager)
+	{
+		return __libc_malloc(size);
+	}
+
+	return Allocate(size, MALLOC_ALIGNMENT);
+}
+
+
+extern "C" void free(void* block)
+{
+	if (tInsideManager)
+	{
+		__libc_free(block);
+		return;
+	}
+
+	Free(block);
+}
+
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+	if (tInsideManager)
+	{
+		return __libc_calloc(count, size);
+	}
+
+	if (size && count > SIZE_MAX / size)
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	// Freshly mapped large blocks are zero-filled already; pooled ones are recycled
+	void* block = Allocate(count * size, MALLOC_ALIGNMENT);
+	if (block && count * size <= MALLOC_MAX_POOLED_SIZE)
+	{
+		memset(block, 0, count * size);
+	}
+
+	return block;
+}
+
+
+extern "C" void* realloc(void* block, size_t size)
+{
+	if (tInsideManager)
+	{
+		return __libc_realloc(block, size);
+	}
+
+	if (!block)
+	{
+		return Allocate(size, MALLOC_ALIGNMENT);
+	}
+
+	if (size == 0)
+	{
+		Free(block);
+		return nullptr;
+	}
+
+	size_t blockSize = IsInitialized() ? gManager->FindMappedBlockSize(block) : 0;
+	bool isLarge = !blockSize && IsInitialized() && IsLargeBlock(block);
+
+	// Allocated by glibc, which resizes it
+	if (!blockSize && !isLarge)
+	{
+		return __libc_realloc(block, size);
+	}
+
+	void* newBlock;
+
+	// Staying in the pools: the block is kept as long as its size class does not change
+	if (blockSize && size <= MALLOC_MAX_POOLED_SIZE)
+	{
+		ManagerScope scope;
+		newBlock = gManager->Reallocate(block, blockSize, size);
+		if (!newBlock)
+		{
+			errno = ENOMEM;
+		}
+
+		return newBlock;
+	}
+
+	// Staying large: the mapping is resized instead of copied
+	if (isLarge && size > MALLOC_MAX_POOLED_SIZE)
+	{
+		newBlock = ReallocateLarge(block, size);
+		if (!newBlock)
+		{
+			errno = ENOMEM;
+		}
+
+		return newBlock;
+	}
+
+	size_t usableSize = blockSize ? blockSize : GetLargeUsableSize(block);
+	newBlock = Allocate(size, MALLOC_ALIGNMENT);
+	if (newBlock)
+	{
+		memcpy(newBlock, block, std::min(size, usableSize));
+		Free(block);
+	}
+
+	return newBlock;
+}
+
+
+extern "C" int posix_memalign(void** block, size_t alignment, size_t size)
+{
+	if (!IsValidAlignment(alignment) || alignment % sizeof(void*) != 0)
+	{
+		return EINVAL;
+	}
+
+	if (tInsideManager)
+	{
+		*block = __libc_memalign(alignment, size);
+		return *block ? 0 : ENOMEM;
+	}
+
+	void* allocated = Allocate(size, alignment);
+	if (!allocated)
+	{
+		return ENOMEM;
+	}
+
+	*block = allocated;
+	return 0;
+}
+
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+	if (!IsValidAlignment(alignment))
+	{
+		errno = EINVAL;
+		return nullptr;
+	}
+
+	if (tInsideManager)
+	{
+		return __libc_memalign(alignment, size);
+	}
+
+	return Allocate(size, alignment);
+}
+
+
+// Obsolete forms glibc still exports. They must be replaced as well, or their blocks would reach free() without coming from Allocate()
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+	return aligned_alloc(alignment, size);
+}
+
+
+extern "C" void* valloc(size_t size)
+{
+	return aligned_alloc(OS_PAGE_SIZE, size);
+}
+
+
+extern "C" void* pvalloc(size_t size)
+{
+	return aligned_alloc(OS_PAGE_SIZE, (size + OS_PAGE_SIZE - 1) / OS_PAGE_SIZE * OS_PAGE_SIZE);
+}
+
+
+extern "C" size_t malloc_usable_size(void* block)
+{
+	if (!block)
+	{
+		return 0;
+	}
+
+	// The Memory Manager only asks about its own bookkeeping, which glibc allocated
+	return tInsideManager ? GetLibcUsableSize(block) : GetUsableSize(block);
+}
+
+#endif // __linux__ && __GLIBC__ && !_DEBUG
@@ -1,207 +1,2437 @@
 /* =========================================================================================
-* 
+*
 *	Class:		Memory Manager
 *	Purpose:	Custom Pool Memory Allocator
 *	Author:		Sreyash (Srey) Raychaudhuri
 *	Date:		12/22/2024
-* 
+*
 * ==========================================================================================
 */
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
 #include <stdio.h>
-#include <unordered_map>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "MemoryManagerConfig.h"
+#include "PlatformMemory.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <xmmintrin.h>
+#endif
 
 #define NUMBITSPERBYTE 8
+#define NUMBITSPERWORD 64
+
+// Prefetch the next free block whenever a block is popped off a free list. Define as 0 to measure without
+#ifndef MM_PREFETCH_FREE_LIST
+#define MM_PREFETCH_FREE_LIST 1
+#endif
+
+// Keep metadata that different threads write on cache lines of its own: chunk headers are padded to whole lines and the remote free
+// list head of each pool on both sides. Define as 0 to measure the unpadded layout
+#ifndef MM_PAD_METADATA
+#define MM_PAD_METADATA 1
+#endif
+
+// ReusePolicy::Random draws each block from a random bitfield word among this many, starting at the word the last block came from
+#define RANDOM_REUSE_WINDOW_WORDS 4
+
+// Call-site of an allocation. Only captured in debug builds, where Allocate() picks it up through default arguments
+struct AllocationCallSite
+{
+	const char* mFile;
+	int mLine;
+};
+
+// The _EXTRA forms follow other parameters
+#ifdef _DEBUG
+#define MM_CALLSITE_PARAMS			const char* file = __builtin_FILE(), int line = __builtin_LINE()
+#define MM_CALLSITE_ARGS			const char* file, int line
+#define MM_CALLSITE_FORWARD			file, line
+#define MM_CALLSITE_EXTRA_PARAMS	, MM_CALLSITE_PARAMS
+#define MM_CALLSITE_EXTRA_ARGS		, MM_CALLSITE_ARGS
+#define MM_CALLSITE_EXTRA_FORWARD	, MM_CALLSITE_FORWARD
+#define MM_CALLSITE					AllocationCallSite{ file, line }
+#else
+#define MM_CALLSITE_PARAMS
+#define MM_CALLSITE_ARGS
+#define MM_CALLSITE_FORWARD
+#define MM_CALLSITE_EXTRA_PARAMS
+#define MM_CALLSITE_EXTRA_ARGS
+#define MM_CALLSITE_EXTRA_FORWARD
+#define MM_CALLSITE					AllocationCallSite{ nullptr, 0 }
+#endif // _DEBUG
+
+// Compact reference to a pooled T. Unlike a pointer it can be checked for staleness: once the block is freed, Resolve() returns nullptr
+// for every copy of the handle, even after the block is handed out again. It also follows the block when Compact() moves it
+template<typename T>
+struct Handle
+{
+	// Index of the block's slot in the handle table of its pool, plus 1. 0 is the null handle
+	uint32_t mIndex = 0;
+
+	// Generation of the block when the handle was issued
+	uint32_t mGeneration = 0;
+
+	explicit operator bool() const { return mIndex != 0; }
+};
+
+// Index of the lowest set bit. value must be non-zero
+inline unsigned int CountTrailingZeros(uint64_t value)
+{
+#if defined(_MSC_VER) && defined(_WIN64)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, static_cast<unsigned long>(value)))
+	{
+		return index;
+	}
+	_BitScanForward(&index, static_cast<unsigned long>(value >> 32));
+	return index + 32;
+#else
+	return __builtin_ctzll(value);
+#endif
+}
+
+// Hint that address is about to be read
+inline void PrefetchBlock(const void* address)
+{
+#if defined(_MSC_VER)
+	_mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+	__builtin_prefetch(address);
+#endif
+}
+
+// xorshift64*: a few cycles per number. Unpredictable enough to scatter heap layouts, not a cryptographic generator. state must not be 0
+inline uint64_t NextRandom(uint64_t& state)
+{
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1Dull;
+}
+
+// Counters of one tag, owned by its TaggedMemoryManager
+struct MemoryTag
+{
+	const char* mName = nullptr;
+
+	// Cap on the live bytes of the tag, 0 for none
+	size_t mQuotaBytes = 0;
+
+	// Bytes of blocks ever allocated and ever freed under the tag. The owner updates its counters without a read-modify-write;
+	// only frees from other threads pay for an atomic add
+	std::atomic<size_t> mAllocatedBytes{ 0 };
+	std::atomic<size_t> mFreedBytes{ 0 };
+	std::atomic<size_t> mRemoteFreedBytes{ 0 };
+
+	// Frees are read first: every block they count was allocated before, so the difference cannot wrap
+	size_t GetFreedBytes() const { return mFreedBytes.load(std::memory_order_acquire) + mRemoteFreedBytes.load(std::memory_order_acquire); }
+	size_t GetLiveBytes() const
+	{
+		size_t freedBytes = GetFreedBytes();
+		return mAllocatedBytes.load(std::memory_order_acquire) - freedBytes;
+	}
+};
+
+// Snapshot of the counters of a tag
+struct MemoryTagStats
+{
+	const char* mTag;
+	size_t mLiveBytes;
+
+	// Running totals. The allocation rate of a tag is the difference in mAllocatedBytes between two snapshots over the time between them
+	size_t mAllocatedBytes;
+	size_t mFreedBytes;
+
+	size_t mQuotaBytes;
+};
 
 class MemoryManager
 {
 public:
 
-	MemoryManager(unsigned int numBlocksPerPool = 10) 
-		: mNumBlocksPerPool(numBlocksPerPool)
+	// Pools of 8, 16 and 32 bytes with numBlocksPerPool blocks each
+	MemoryManager(size_t numBlocksPerPool = 10)
+		: MemoryManager(MemoryManagerConfig::Default(numBlocksPerPool)) {}
+
+	// Pools for every size class listed in config. The constructing thread becomes the owner
+	explicit MemoryManager(const MemoryManagerConfig& config)
+		: mConfig(config), mOwnerThread(std::this_thread::get_id()), mBudgetBytes(config.mBudgetBytes)
 	{
-		// Pools where size of each data type = 2 pow exp;
-		for (int exponent = 3; exponent <= 5; exponent++)
+		for (const SizeClassConfig& sizeClass : config.mSizeClasses)
 		{
-			InitializePool(pow(2, exponent), numBlocksPerPool);
+			InitializePool(sizeClass);
 		}
 	}
 
 	~MemoryManager()
 	{
+		DrainRemoteFrees();
+
+		if (mReportLeaks)
+		{
+			ReportLeaks();
+		}
+
 		// Releasing pools
 		for (auto iter = mPool.begin(); iter != mPool.end(); ++iter)
 		{
-			delete[] reinterpret_cast<char*>((*iter).second);
+			ReleaseUpstreamBlocks((*iter).second);
+
+			for (Chunk& chunk : (*iter).second.mChunks)
+			{
+				ReleaseChunkMemory((*iter).second, chunk);
+			}
 		}
 
 		mPool.clear();
 	}
 
-	// Preallocate a block of memory
-	void InitializePool(size_t size, uint16_t numBytes);
+	MemoryManager(const MemoryManager&) = delete;
+	MemoryManager& operator=(const MemoryManager&) = delete;
+
+	// Preallocate a pool of numBlocks blocks of size bytes each, with the configured default growth policy and backing.
+	// Returns false if the pool size overflows or memory cannot be reserved
+	bool InitializePool(size_t size, size_t numBlocks);
 
-	// Allocate a block of memory and return starting address of allocated block
+	// Preallocate a pool as described by sizeClass
+	bool InitializePool(const SizeClassConfig& sizeClass);
+
+	// Allocate a block of memory and return starting address of allocated block.
+	// The block comes from the smallest pool that fits T; a pool of the configured defaults is created if none does
 	template<typename T>
-	T* Allocate();
-	
-	// Free memory pointed to by ptr variable var
+	T* Allocate(MM_CALLSITE_PARAMS);
+
+	// Free memory pointed to by ptr variable var.
+	// May be called from any thread: frees from threads other than the owner are queued on the pool and picked up by the owner's next Allocate().
+	// Pools must not be created while other threads free into the manager
 	template<typename T>
 	void Free(T** pointer);
 
+	// Untyped Allocate / Free, for callers that only know the size of the object (allocator front ends, operator new).
+	// Free returns false if the block was rejected (null, foreign or double free)
+	void* Allocate(size_t size MM_CALLSITE_EXTRA_PARAMS);
+	bool Free(void* block, size_t size);
+
+	// Resize a block allocated for oldSize bytes to newSize bytes. The block is returned as is when the same pool serves both sizes;
+	// otherwise its contents move to a block of the pool for newSize and it is freed. nullptr (block left untouched) if that pool is exhausted.
+	// A null block is allocated. Moves always copy: every block lives in a pool, so there is no mapping of its own to mremap() as the
+	// malloc replacement does for large blocks
+	void* Reallocate(void* block, size_t oldSize, size_t newSize MM_CALLSITE_EXTRA_PARAMS);
+
+	// Allocate that never throws or waits: nullptr right away if the block would take the manager past its budget or the pool past
+	// its quota, or if the pool is exhausted. The exhaustion policy of the pool (grow, upstream, handler, throw) is not applied
+	void* TryAllocate(size_t size MM_CALLSITE_EXTRA_PARAMS);
+
+	// Allocate that applies back-pressure: while the budget, the quota or the pool is used up, wait for other threads to free blocks
+	// for up to timeout. nullptr once it runs out
+	template<typename Rep, typename Period>
+	void* Allocate(size_t size, const std::chrono::duration<Rep, Period>& timeout MM_CALLSITE_EXTRA_PARAMS);
+
+	// Allocate a block and return a handle to it instead of a pointer. Null handle if the pool is exhausted or has more than 2^32 blocks
+	template<typename T>
+	Handle<T> AllocateHandle(MM_CALLSITE_PARAMS);
+
+	// Handle to a block allocated through Allocate()
+	template<typename T>
+	Handle<T> GetHandle(const T* pointer);
+
+	// Block a handle refers to. nullptr if the handle is null or stale (its block has been freed since)
+	template<typename T>
+	T* Resolve(Handle<T> handle);
+
+	// Free the block a handle refers to and null the handle. Stale handles are rejected
+	template<typename T>
+	void Free(Handle<T>* handle);
+
+	// Called when a pool with ExhaustionPolicy::Handler is exhausted, with its size class. Returns true once blocks may have been freed
+	// (or the pool otherwise made room) for the allocation to be retried, false to fail it
+	void SetExhaustionHandler(std::function<bool(size_t sizeClass)> handler) { mExhaustionHandler = std::move(handler); }
+
+	// Allocator that pools with ExhaustionPolicy::Upstream fall back to. malloc() / free() unless set
+	void SetUpstreamAllocator(std::function<void*(size_t size)> allocate, std::function<void(void* block)> free)
+	{
+		mUpstreamAllocate = std::move(allocate);
+		mUpstreamFree = std::move(free);
+	}
+
+	// Cap on the bytes of blocks allocated across every pool, 0 for none. Lowering it below current usage fails allocations until enough is freed
+	void SetBudget(size_t bytes) { mBudgetBytes = bytes; }
+
+	// Cap on the bytes of blocks allocated from the pool of the given size class, 0 for none. Returns false if there is no such pool
+	bool SetQuota(size_t sizeClass, size_t bytes);
+
+	// Bytes of blocks currently allocated across every pool (block size times live blocks). May be read from any thread
+	size_t GetUsedBytes() const { return mUsedBytes.load(std::memory_order_relaxed); }
+
+	// Bytes of blocks currently allocated from the pool of the given size class
+	size_t GetUsedBytes(size_t sizeClass) const;
+
+	// Counters of every TaggedMemoryManager over this manager, in creation order. Owner thread only
+	std::vector<MemoryTagStats> GetTagStats() const;
+
+	// Only the owner thread may allocate, reset, enumerate or create pools. Hand the manager over to the calling thread
+	void SetOwnerThread() { mOwnerThread = std::this_thread::get_id(); }
+
+	// Take back every block other threads freed into the pools so far, and return how many. Owner thread only
+	size_t DrainRemoteFrees();
+
+	// Size class of the pool serving blocks of size bytes, 0 if there is none yet
+	size_t GetSizeClass(size_t size) const;
+
+	// Number of blocks currently reserved by the pool of the given size class, allocated or not
+	size_t GetCapacity(size_t sizeClass) const;
+
+	// Block size of the pool whose storage contains block, 0 if it lies in no pool. Lets front ends that only get a pointer back
+	// (free(), malloc_usable_size()) find its size class
+	size_t GetBlockSize(const void* block) const;
+
+	// GetBlockSize() that any thread may call, even while the owner adds and releases chunks, as it takes no lock and reads no
+	// container of the manager. Only finds blocks of chunks mapped from the OS, and only if the config sets mTrackMappedPages: 0 otherwise
+	size_t FindMappedBlockSize(const void* block) const { return mMappedPages.Get(block); }
+
+	// Invoke callback(void* block) for every allocated block in the pool of the given size class, in address order
+	template<typename Callback>
+	void ForEachLive(size_t sizeClass, Callback callback);
+
+	// Number of allocated blocks in the pool of the given size class
+	size_t CountLive(size_t sizeClass);
+
+	// Invoke fn(T&) for every allocated block in the pool of T, in address order. Every live block of the size class is treated as a T,
+	// so the pool must only hold Ts
+	template<typename T, typename Callback>
+	void ForEach(Callback fn);
+
+	// Range over the allocated blocks in the pool of T, in address order, for use in range-based for loops. Same caveat as ForEach().
+	// Allocating, freeing or resetting blocks of the pool invalidates the range
+	template<typename T>
+	class LiveRange;
+
+	template<typename T>
+	LiveRange<T> Live();
+
+	// Print blocks that are still allocated, per size class. Returns the total number of such blocks
+	size_t ReportLeaks();
+
+	// Whether the destructor prints a leak report before releasing the pools. On by default in debug builds
+	void SetLeakReporting(bool enable) { mReportLeaks = enable; }
+
+	// Mark every block of the pool of the given size class as free in one go, in O(chunks). Outstanding pointers into the pool become
+	// invalid and handles to its blocks stale
+	void Reset(size_t sizeClass);
+
+	// Reset every pool
+	void Reset();
+
+	// Move live blocks of the pool of the given size class out of its sparsest chunks into free blocks of its densest ones,
+	// and release chunks left empty. move(void* destination, void* source) relocates one object; the source block is freed afterwards.
+	// At most maxMoves blocks are moved per call, so compaction can be spread over several frames. Returns the number of blocks moved.
+	// Handles follow moved blocks; raw pointers to them are left dangling
+	template<typename MoveCallback>
+	size_t Compact(size_t sizeClass, MoveCallback move, size_t maxMoves = SIZE_MAX);
+
+	// Compact the pool of T, relocating objects by memcpy if T is trivially copyable or by move construction otherwise
+	template<typename T>
+	size_t Compact(size_t maxMoves = SIZE_MAX);
+
 private:
-	unsigned int mNumBlocksPerPool;
-	std::unordered_map<size_t, void*> mPool;
+	friend class TaggedMemoryManager;
+
+	// Lists chunks are kept on by how many of their blocks are live
+	enum ChunkList
+	{
+		EMPTYCHUNKS,
+		PARTIALCHUNKS,
+		FULLCHUNKS,
+		NUMCHUNKLISTS
+	};
+
+	// One contiguous allocation of blocks. A pool starts with one chunk (or one run of slabs) and gains more as it grows.
+	// Layout: [[Ptr to first free block][Ptr to first untouched block][Live block count][Bitfield to determine allocated blocks][Actual Storage]]
+	// The header sits right before the blocks it describes, so with slabs it shares pages with them, but with MM_PAD_METADATA it is padded to whole cache lines:
+	// a thread writing into the first block never invalidates the line the owner updates on every allocation
+	struct Chunk
+	{
+		// First block
+		char* mMemory = nullptr;
+		size_t mNumBlocks = 0;
+
+		// Header, at the start of the reservation
+		uintptr_t* mMetadata = nullptr;
+
+		// End of the last block
+		char* mEnd = nullptr;
+
+		// Reserved size and backing, to release the chunk
+		size_t mBytes = 0;
+		PoolBacking mBacking = PoolBacking::Heap;
+
+		// Handle slot of each block plus 1, 0 if no handle was issued for it. Parallel to the bitfield; only created once the chunk hands out handles
+		std::unique_ptr<uint32_t[]> mHandleSlots;
+
+		// Reuse policies other than LIFO find freed blocks through the bitfield, and leave the free list empty.
+		// Number of freed blocks below the first untouched block, and the first bitfield word that may hold one
+		// (ReusePolicy::Random: the word the last block came from)
+		size_t mNumRecycled = 0;
+		size_t mSearchWord = 0;
+
+		// ReusePolicy::FullestPage: freed blocks on each page of the chunk, and the page blocks are currently taken from (SIZE_MAX for none)
+		std::vector<uint32_t> mPageFreeCounts;
+		size_t mCurrentPage = SIZE_MAX;
+
+		// Links in the empty, partial or full list of the pool, by chunk index (SIZE_MAX for none)
+		size_t mList = NUMCHUNKLISTS;
+		size_t mPreviousChunk = SIZE_MAX;
+		size_t mNextChunk = SIZE_MAX;
+
+#ifdef _DEBUG
+		// Call-site that allocated each block
+		std::vector<AllocationCallSite> mCallSites;
+#endif // _DEBUG
+	};
+
+	// Entry of the handle table. Handles index slots rather than blocks, so Compact() can move a block by updating its slot
+	struct HandleSlot
+	{
+		// Block the slot refers to, nullptr while the slot is free
+		void* mBlock = nullptr;
+
+		// Bumped when the block is freed, which makes every handle to the slot stale
+		uint32_t mGeneration = 0;
+
+		// While the slot is free: next free slot plus 1
+		uint32_t mNextFreeSlot = 0;
+	};
+
+	struct Pool
+	{
+		SizeClassConfig mConfig;
+		std::vector<Chunk> mChunks;
+		size_t mTotalBlocks = 0;
+
+		// First chunk and number of chunks on each list
+		size_t mChunkListHeads[NUMCHUNKLISTS] = { SIZE_MAX, SIZE_MAX, SIZE_MAX };
+		size_t mChunkListSizes[NUMCHUNKLISTS] = { 0, 0, 0 };
+
+		// Chunk index by address of the first block, to find the chunk a pointer falls into
+		std::map<uintptr_t, size_t> mChunksByAddress;
+
+		// Chunk that Allocate() takes blocks from until it runs out
+		size_t mActiveChunk = 0;
+
+		// Blocks freed by other threads, linked through their first word like the free lists.
+		// Any thread pushes, only the owner takes the whole list at once, so there is no ABA problem.
+		// Padded on both sides: pushes would otherwise invalidate the line holding the fields the owner reads on every allocation
+#if MM_PAD_METADATA
+		char mRemoteFreeListPadding[CACHE_LINE_SIZE];
+#endif // MM_PAD_METADATA
+		std::atomic<uintptr_t> mRemoteFreeListHead{ 0 };
+#if MM_PAD_METADATA
+		char mRemoteFreeListPaddingAfter[CACHE_LINE_SIZE];
+#endif // MM_PAD_METADATA
+
+		// Handle table, and the first free slot in it plus 1
+		std::vector<HandleSlot> mHandleSlots;
+		uint32_t mFreeHandleSlot = 0;
+
+		// Slots handed out since the last Reset(), which are the first ones of the table. Handles to later slots date from before it
+		// and are stale, so Reset() invalidates every handle by zeroing this rather than visiting each slot
+		uint32_t mIssuedHandleSlots = 0;
+
+		// Blocks taken from the upstream allocator under ExhaustionPolicy::Upstream. Free() only looks here for pointers outside every chunk
+		std::unordered_set<void*> mUpstreamBlocks;
+
+		// Bytes of blocks allocated from the pool, counted against mConfig.mQuotaBytes
+		size_t mUsedBytes = 0;
+
+		// State of the generator behind ReusePolicy::Random, seeded per pool
+		uint64_t mRandomState = 0;
+	};
+
+	// Holds the address of the first free block
+	static uintptr_t* GetFreeListHead(const Chunk& chunk) { return chunk.mMetadata; }
+
+	// Holds the address of the first block never handed out since the last reset.
+	// Blocks from there to the end of the storage are not threaded on the free list
+	static uintptr_t* GetFirstUntouchedBlock(const Chunk& chunk) { return chunk.mMetadata + 1; }
+
+	// Number of allocated blocks
+	static size_t* GetLiveCount(const Chunk& chunk) { return reinterpret_cast<size_t*>(chunk.mMetadata + 2); }
+
+	// Allocation-tracking bitfield. Bit (i % 64) of word (i / 64) is set while block i is allocated
+	static uint64_t* GetBitfield(const Chunk& chunk) { return reinterpret_cast<uint64_t*>(chunk.mMetadata + 3); }
+
+	static size_t GetBitfieldWordCount(size_t numBlocks) { return (numBlocks / NUMBITSPERWORD) + ((numBlocks % NUMBITSPERWORD) != 0); }
+
+	// Size of the header of a chunk of numBlocks blocks, rounded up to whole cache lines (with MM_PAD_METADATA)
+	static size_t GetHeaderBytes(size_t numBlocks);
+
+	// Total size of a chunk: metadata followed by blocks. Returns 0 if that does not fit in a size_t
+	static size_t GetChunkBytes(size_t size, size_t numBlocks);
+
+	// Blocks of the given size that fit in a slab of slabBytes, header included. At least 1
+	static size_t GetBlocksPerSlab(size_t size, size_t slabBytes);
+
+	static bool HasFreeBlock(const Chunk& chunk) { return *GetFreeListHead(chunk) || chunk.mNumRecycled || *GetFirstUntouchedBlock(chunk) != reinterpret_cast<uintptr_t>(chunk.mEnd); }
+
+	// Blocks per page for ReusePolicy::FullestPage. Blocks larger than a page count as a page of their own
+	static size_t GetBlocksPerPage(size_t blockSize) { return std::max<size_t>(1, OS_PAGE_SIZE / blockSize); }
+
+	// Empty the free list and clear the bitfield, leaving every block untouched
+	static void ResetChunk(Chunk& chunk);
+
+	// ReusePolicy::Random: count every block of an empty chunk as recycled, so even the first allocations come from the bitfield at random
+	static void RecycleAllBlocks(Chunk& chunk);
+
+	// Pool serving blocks of size bytes. If there is none, one is created with the configured defaults when create is set
+	Pool* GetPool(size_t size, bool create);
+
+	// Add numBlocks blocks to the pool: one chunk, or as many slabs as they take with the slab layout. The last chunk added becomes the active one
+	bool Grow(Pool& pool, size_t numBlocks);
+
+	// Add a chunk of numBlocks blocks to the pool and make it the active chunk
+	bool AddChunk(Pool& pool, size_t numBlocks);
+
+	// Put a chunk on the list matching its live count. Only relinks when the chunk just became empty, partial or full
+	static void UpdateChunkList(Pool& pool, size_t chunkIndex);
+	static void UnlinkChunk(Pool& pool, size_t chunkIndex);
+
+	// Give a chunk back to the OS. The last chunk of the pool takes over its index
+	void ReleaseChunk(Pool& pool, size_t chunkIndex);
+
+	// Unlock (FaultPolicy::Lock) and release the memory of a chunk
+	static void ReleaseChunkMemory(const Pool& pool, const Chunk& chunk);
+
+	// Make sure the active chunk has a block on its free list, switching chunks or growing the pool as needed. Returns false if the pool is exhausted
+	bool RefillFreeList(Pool& pool);
+
+	// Chunk of the pool whose storage contains pointer, nullptr if none does
+	static Chunk* FindChunk(Pool& pool, const void* pointer);
+
+	// Handle to an allocated block of the pool. Takes a handle slot for the block if it has none yet
+	static bool MakeHandle(Pool& pool, const void* block, uint32_t& index, uint32_t& generation);
+
+	// Return a slot to the handle table, making handles to it stale
+	static void ReleaseHandleSlot(Pool& pool, uint32_t slot);
+
+	// Take the free block of the given chunk that the reuse policy of the pool prefers, and mark it allocated. nullptr if the chunk is full
+	static void* TakeBlock(Pool& pool, Chunk& chunk);
+
+	// Mark an allocated block free and make it available again according to the reuse policy of the pool
+	static void ReleaseBlock(Pool& pool, Chunk& chunk, size_t blockIndex);
+
+	// Index of the lowest free block in [begin, end), end if there is none
+	static size_t FindFreeBlock(const Chunk& chunk, size_t begin, size_t end);
+
+	// ReusePolicy::Random: index of a free block drawn near the last one. The chunk must have a recycled block
+	static size_t FindRandomFreeBlock(Pool& pool, Chunk& chunk);
+
+	void* AllocateBlock(Pool& pool, const AllocationCallSite& callSite);
+	bool FreeBlock(Pool& pool, void* block);
+
+	// Whether one more block of the pool fits in the budget and the quota of the pool
+	bool HasBudgetFor(const Pool& pool) const;
+
+	// AllocateBlock() if the budget and quota allow, and count the block against them
+	void* AllocateWithinBudget(Pool& pool, const AllocationCallSite& callSite);
+
+	// Whether any pool has blocks queued by other threads
+	bool HasRemoteFrees() const;
+
+	// Free() once the pool is known: queued if called from another thread
+	bool FreeToPool(Pool& pool, void* block);
+
+	// Allocate() / Free() on behalf of a tag, counting the block size against it
+	void* AllocateTagged(size_t size, MemoryTag& tag, const AllocationCallSite& callSite);
+	bool FreeTagged(void* block, size_t size, MemoryTag& tag);
+
+	static MemoryTagStats GetTagStats(const MemoryTag& tag);
+
+	// Apply the exhaustion policy of a pool that has no free block left and cannot grow. Kept off the allocation fast path
+	void* AllocateOnExhaustion(Pool& pool, const AllocationCallSite& callSite);
+
+	// Hand every block the pool took from upstream back to it
+	void ReleaseUpstreamBlocks(Pool& pool);
+
+	// Queue a block freed by a thread other than the owner. One atomic push
+	static void PushRemoteFree(Pool& pool, void* block);
+
+	// Free every block queued by other threads into the pool. Returns the number of blocks taken back
+	size_t DrainRemoteFrees(Pool& pool);
+
+	template<typename Callback>
+	static void ForEachLiveInChunk(const Chunk& chunk, size_t blockSize, Callback callback);
+
+	MemoryManagerConfig mConfig;
+
+	// Key = block size of the pool. Ordered so the smallest pool that fits a size is a lower_bound away
+	std::map<size_t, Pool> mPool;
+
+	// End of the blocks of each chunk and block size of its pool, by address of the chunk's first block. Spans every pool, unlike Pool::mChunksByAddress
+	std::map<uintptr_t, std::pair<uintptr_t, size_t>> mChunkExtents;
+
+	// Block size of the pool holding each page of the blocks of mapped chunks, with MemoryManagerConfig::mTrackMappedPages
+	PageMap mMappedPages;
+
+	std::thread::id mOwnerThread;
+
+	std::function<bool(size_t)> mExhaustionHandler;
+	std::function<void*(size_t)> mUpstreamAllocate = malloc;
+	std::function<void(void*)> mUpstreamFree = free;
+
+	// Set by TryAllocate() for the duration of the call, so that an exhausted pool returns nullptr whatever its policy. Owner thread only
+	bool mSkipExhaustionPolicy = false;
+
+	size_t mBudgetBytes = 0;
+
+	// Written by the owner only, read by anyone
+	std::atomic<size_t> mUsedBytes{ 0 };
+
+	// Owners blocked in Allocate() with a timeout sleep on the condition variable, and remote frees wake them only while mFreeWaiters is set
+	std::mutex mFreeWaitMutex;
+	std::condition_variable mFreeCondition;
+	std::atomic<int> mFreeWaiters{ 0 };
+
+	// Tags of the TaggedMemoryManagers over this manager
+	std::vector<MemoryTag*> mTags;
+
+#ifdef _DEBUG
+	bool mReportLeaks = true;
+#else
+	bool mReportLeaks = false;
+#endif // _DEBUG
 };
 
 
-void MemoryManager::InitializePool(size_t size, uint16_t numBlocks)
+// Scope for request- or frame-lived allocations: every block of the manager (or of one of its pools) is released when the arena goes out of scope,
+// without an individual Free per object. Objects allocated here must not need their destructors run
+class ScopedArena
 {
-	// Pre-allocate memory on the heap. 
-	// Add an extra block in the end - will store address value of first available free block in the pool
-	// Extra (numBlocks/8) bytes for more metadata. ith bit indicates allocation status for ith block in this pool
-	// Bit = 1 means block is allocated, free otherwise
-	
-	// Layout: [Key = Size of each elem] ---> Memory: [[Actual Storage][Ptr to first free block][Bitfield to determine allocated blocks]]
+public:
+	// Arena over every pool of the manager
+	explicit ScopedArena(MemoryManager& memoryManager)
+		: mMemoryManager(memoryManager), mSizeClass(0) {}
+
+	// Arena over the pool of a single size class
+	ScopedArena(MemoryManager& memoryManager, size_t sizeClass)
+		: mMemoryManager(memoryManager), mSizeClass(sizeClass) {}
+
+	~ScopedArena()
+	{
+		if (mSizeClass)
+		{
+			mMemoryManager.Reset(mSizeClass);
+		}
+		else
+		{
+			mMemoryManager.Reset();
+		}
+	}
+
+	ScopedArena(const ScopedArena&) = delete;
+	ScopedArena& operator=(const ScopedArena&) = delete;
+
+	template<typename T>
+	T* Allocate(MM_CALLSITE_PARAMS) { return mMemoryManager.Allocate<T>(MM_CALLSITE_FORWARD); }
+
+private:
+	MemoryManager& mMemoryManager;
+	size_t mSizeClass;
+};
 
-	mPool[size] = (void*)(new char[(size * numBlocks) + sizeof(void*) + (numBlocks / NUMBITSPERBYTE) + 1]);
+// View of a MemoryManager that allocates from its pools under a tag, so pool memory can be attributed to the subsystem using it.
+// Each view keeps its own counters and an optional quota, checked on top of the budget and pool quotas of the manager; allocating through
+// a view costs one extra add. Blocks must be freed through the view that allocated them. Reset() of the manager leaves the counters alone.
+// Views are created and destroyed on the owner thread, and must not outlive the manager
+class TaggedMemoryManager
+{
+public:
+	TaggedMemoryManager(MemoryManager& memoryManager, const char* tag, size_t quotaBytes = 0)
+		: mMemoryManager(memoryManager)
+	{
+		mTag.mName = tag;
+		mTag.mQuotaBytes = quotaBytes;
+		mMemoryManager.mTags.push_back(&mTag);
+	}
 
-	// Store address of each next available free block in the free block itself
-	// This works only if sizeof(element) >= sizeof(void*)
-	// Here sizeof(void*) = 64 bits (8 bytes); So will work with pools where size of each element >= 8 bytes
+	~TaggedMemoryManager()
+	{
+		std::vector<MemoryTag*>& tags = mMemoryManager.mTags;
+		tags.erase(std::remove(tags.begin(), tags.end(), &mTag), tags.end());
+	}
 
-	uintptr_t* firstFreeBlockAddress = reinterpret_cast<uintptr_t*>(mPool[size]);
-	uintptr_t* currentFreeBlockAddress = firstFreeBlockAddress;
+	TaggedMemoryManager(const TaggedMemoryManager&) = delete;
+	TaggedMemoryManager& operator=(const TaggedMemoryManager&) = delete;
 
-	uint8_t stride = (size / sizeof(void*));
+	template<typename T>
+	T* Allocate(MM_CALLSITE_PARAMS) { return reinterpret_cast<T*>(mMemoryManager.AllocateTagged(sizeof(T), mTag, MM_CALLSITE)); }
 
-	// Store addresses of next available free block from each free block within the free blocks themselves
-	for (int iteration = 1; iteration < numBlocks; ++iteration)
+	template<typename T>
+	void Free(T** pointer)
 	{
-		*currentFreeBlockAddress = reinterpret_cast<uintptr_t>((currentFreeBlockAddress + stride));
-		currentFreeBlockAddress += stride;
+		if (mMemoryManager.FreeTagged(*pointer, sizeof(T), mTag))
+		{
+			*pointer = nullptr;
+		}
 	}
 
-	// Next from last block will be nullptr.
-	*currentFreeBlockAddress = NULL;
+	void* Allocate(size_t size MM_CALLSITE_EXTRA_PARAMS) { return mMemoryManager.AllocateTagged(size, mTag, MM_CALLSITE); }
+	bool Free(void* block, size_t size) { return mMemoryManager.FreeTagged(block, size, mTag); }
+
+	// Cap on the bytes of blocks allocated through the view at once, 0 for none
+	void SetQuota(size_t bytes) { mTag.mQuotaBytes = bytes; }
+
+	// May be called from any thread
+	size_t GetLiveBytes() const { return mTag.GetLiveBytes(); }
+	MemoryTagStats GetStats() const { return MemoryManager::GetTagStats(mTag); }
 
-	// The last element will store the address of the first free block in this pool
-	currentFreeBlockAddress += stride;
-	*currentFreeBlockAddress = reinterpret_cast<uintptr_t>(firstFreeBlockAddress);
+private:
+	MemoryManager& mMemoryManager;
+	MemoryTag mTag;
+};
+
+
+inline bool MemoryManager::InitializePool(size_t size, size_t numBlocks)
+{
+	SizeClassConfig sizeClass = mConfig.mDefaults;
+	sizeClass.mBlockSize = size;
+	sizeClass.mInitialBlocks = numBlocks;
+
+	return InitializePool(sizeClass);
 }
 
 
-template<typename T>
-T* MemoryManager::Allocate()
+inline bool MemoryManager::InitializePool(const SizeClassConfig& sizeClass)
 {
-	size_t dataTypeSize = sizeof(T);
-	if (!mPool[dataTypeSize]) // If value is not 0, pool for elements of size sizeof(T) exists
+	size_t size = sizeClass.mBlockSize;
+
+	// Freed blocks store the address of the next free block within themselves, which works only if sizeof(element) >= sizeof(void*)
+	if (size < sizeof(void*) || sizeClass.mInitialBlocks == 0)
 	{
-		InitializePool(dataTypeSize, mNumBlocksPerPool);
+#ifdef _DEBUG
+		printf("[FAILURE] Invalid pool of %zu blocks of size class %zu\n", sizeClass.mInitialBlocks, size);
+#endif // _DEBUG
+		return false;
 	}
 
-	// First grab the address of the first free available block where we can store our value. 
-    // This address is stored after the last block in the pool
-	uintptr_t* firstElementPtr = reinterpret_cast<uintptr_t*>(mPool[dataTypeSize]);
-	uintptr_t* lastElementPtr = reinterpret_cast<uintptr_t*>(firstElementPtr + (dataTypeSize / sizeof(void*)) * mNumBlocksPerPool);
-	
-	// First check if pool is full
-	if (*lastElementPtr == NULL)
+	if (mPool.find(size) != mPool.end())
 	{
 #ifdef _DEBUG
-		printf("[FAILURE] Pool exhausted!\n\n");
+		printf("[FAILURE] Pool of size class %zu already exists\n", size);
 #endif // _DEBUG
-		return nullptr;
+		return false;
 	}
 
-	uintptr_t firstFreeBlockAddressValue = *lastElementPtr;
-
-	// Need to mark this block as allocated by setting the correct bit in the allocation-tracking bitfield.
-	unsigned int indexBlockAllocated = (firstFreeBlockAddressValue - reinterpret_cast<uintptr_t>(firstElementPtr)) / dataTypeSize;
-	unsigned char* desiredByte = reinterpret_cast<unsigned char*>(reinterpret_cast<uintptr_t>(lastElementPtr) + sizeof(void*) + (indexBlockAllocated / NUMBITSPERBYTE));
-	*(desiredByte) |= (1 << (NUMBITSPERBYTE - (indexBlockAllocated % NUMBITSPERBYTE) - 1));
+	Pool& pool = mPool[size];
+	pool.mConfig = sizeClass;
 
+	if (sizeClass.mReusePolicy == ReusePolicy::Random)
+	{
+		std::random_device seed;
+		pool.mRandomState = ((static_cast<uint64_t>(seed()) << 32) ^ seed() ^ reinterpret_cast<uintptr_t>(&pool)) | 1;
+	}
 
-#ifdef _DEBUG
-	printf("\n[SUCCESS] Index of allocated block\t= %d\nAddress of desired byte\t= %p\nByte after setting status\t= %x\nAllocating block at\t= %p\n", 
-			indexBlockAllocated, 
-			desiredByte,
-			*(reinterpret_cast<unsigned char*>(desiredByte)),
-			(void*)firstFreeBlockAddressValue
-		);
-#endif // _DEBUG
+	size_t numBlocks = sizeClass.mInitialBlocks;
+	if (sizeClass.mMaxBlocks && numBlocks > sizeClass.mMaxBlocks)
+	{
+		numBlocks = sizeClass.mMaxBlocks;
+	}
 
-	uintptr_t temp = firstFreeBlockAddressValue;
+	if (!Grow(pool, numBlocks))
+	{
+		mPool.erase(size);
+		return false;
+	}
 
-	// The value in this free block is the next available free block - which will now become the first free block
-	firstFreeBlockAddressValue = *(reinterpret_cast<uintptr_t*>(firstFreeBlockAddressValue));
+	return true;
+}
 
-	// Now store the actual value. Using temp since firstFreeBlockAddressValue got updated
-	T* newValueAddress = reinterpret_cast<T*>(temp);
 
-	*lastElementPtr = firstFreeBlockAddressValue;
+inline bool MemoryManager::Grow(Pool& pool, size_t numBlocks)
+{
+	size_t slabBytes = pool.mConfig.mSlabBytes;
+	if (slabBytes == 0)
+	{
+		return AddChunk(pool, numBlocks);
+	}
 
-#ifdef _DEBUG
-	printf("Next block from first free block =\t%p\n\n", (void*)firstFreeBlockAddressValue);
-#endif // _DEBUG
+	size_t blocksPerSlab = GetBlocksPerSlab(pool.mConfig.mBlockSize, slabBytes);
+	size_t addedBlocks = 0;
+	while (addedBlocks < numBlocks && AddChunk(pool, std::min(blocksPerSlab, numBlocks - addedBlocks)))
+	{
+		addedBlocks += std::min(blocksPerSlab, numBlocks - addedBlocks);
+	}
 
-	return newValueAddress;
+	return addedBlocks > 0;
 }
 
 
-template<typename T>
-void MemoryManager::Free(T** ppBlock)
+inline bool MemoryManager::AddChunk(Pool& pool, size_t numBlocks)
 {
+	// Pre-allocate memory on the heap (or straight from the OS for large chunks).
+	// First word - will store address value of first available free block in the chunk
+	// Another one after it - will store address value of the first block never handed out
+	// Another one after it - will store the number of allocated blocks
+	// Extra (numBlocks/8) bytes for more metadata. ith bit indicates allocation status for ith block in this chunk
+	// Bit = 1 means block is allocated, free otherwise
+
+	// The bitfield is stored as 64-bit words so that it can be scanned a word at a time
+
+	size_t size = pool.mConfig.mBlockSize;
+	Chunk chunk;
+	chunk.mNumBlocks = numBlocks;
+	chunk.mBytes = GetChunkBytes(size, numBlocks);
+	chunk.mBacking = pool.mConfig.mBacking;
+	chunk.mMetadata = chunk.mBytes ? reinterpret_cast<uintptr_t*>(AllocatePoolMemory(chunk.mBytes, chunk.mBacking)) : nullptr;
+	if (!chunk.mMetadata)
+	{
 #ifdef _DEBUG
-	printf("Attempting to free memory at address = %p\n", *ppBlock);
+		printf("[FAILURE] Could not reserve %zu blocks for pool of size class %zu\n", numBlocks, size);
 #endif // _DEBUG
+		return false;
+	}
 
-	if (*ppBlock == nullptr)
+	// Low-latency pools back every page up front, before the header is written, so no block faults on first touch
+	FaultPolicy faultPolicy = pool.mConfig.mFaultPolicy;
+	if (faultPolicy != FaultPolicy::Lazy && !PrefaultPages(chunk.mMetadata, chunk.mBytes, faultPolicy == FaultPolicy::Lock))
 	{
 #ifdef _DEBUG
-		printf("[FAILURE]Invalid pointer passed\n", *ppBlock);
+		printf("[FAILURE] Could not lock %zu bytes for pool of size class %zu\n", chunk.mBytes, size);
 #endif // _DEBUG
-		return;
+		ReleasePoolMemory(chunk.mMetadata, chunk.mBytes, chunk.mBacking);
+		return false;
 	}
 
-	size_t dataTypeSize = sizeof(T);
+	chunk.mMemory = reinterpret_cast<char*>(chunk.mMetadata) + GetHeaderBytes(numBlocks);
+	chunk.mEnd = chunk.mMemory + size * numBlocks;
 
-	uintptr_t* firstElementPtr = reinterpret_cast<uintptr_t*>(mPool[dataTypeSize]);
-	uintptr_t* lastElementPtr = reinterpret_cast<uintptr_t*>(firstElementPtr + (dataTypeSize / sizeof(uintptr_t)) * mNumBlocksPerPool);
-	
-	unsigned int indexBlockAllocated = (reinterpret_cast<uintptr_t>(*ppBlock) - reinterpret_cast<uintptr_t>(firstElementPtr)) / dataTypeSize;
-	unsigned char* desiredByte = reinterpret_cast<unsigned char*>(reinterpret_cast<uintptr_t>(lastElementPtr) + sizeof(void*) + (indexBlockAllocated / NUMBITSPERBYTE));
-	unsigned int shiftValue = NUMBITSPERBYTE - (indexBlockAllocated % NUMBITSPERBYTE) - 1;
-	
-	// If bit at the ith index of the bitfield 
-	// which denotes allocation status of ith block. If already 0, we're trying to do a double free
-	if ((*desiredByte & (1 << shiftValue)) == 0) 
+	// Heap chunks may share pages with other allocations, so only mapped ones are recorded
+	if (mConfig.mTrackMappedPages && chunk.mBacking != PoolBacking::Heap && !mMappedPages.Set(chunk.mMemory, size * numBlocks, size))
 	{
 #ifdef _DEBUG
-		printf("[FAILURE] Attempting a double free!\n");
+		printf("[FAILURE] Could not record the pages of a chunk for pool of size class %zu\n", size);
 #endif // _DEBUG
-
-		return;
+		mMappedPages.Set(chunk.mMemory, size * numBlocks, 0);
+		ReleaseChunkMemory(pool, chunk);
+		return false;
 	}
 
-	*desiredByte ^= (1 << shiftValue); // Bit was 1; XOR with 1 to make it 0 (status set to free)
+	// Blocks are not threaded up front. The free list starts empty and Allocate() hands out untouched blocks in address order,
+	// so adding a chunk is O(1) and block storage is not touched until used.
+	// No block is allocated yet. Memory mapped from the OS is already zeroed
+	if (chunk.mBacking == PoolBacking::Heap)
+	{
+		ResetChunk(chunk);
+	}
+	else
+	{
+		*GetFirstUntouchedBlock(chunk) = reinterpret_cast<uintptr_t>(chunk.mMemory);
+	}
 
-	// Location pointed to by pointer to be freed will now hold the address value of the next free block which is the previous first free available block
-	*(reinterpret_cast<uintptr_t*>(*ppBlock)) = *lastElementPtr;
-	
-	// First free block address = Address of pointer freed
-	*lastElementPtr = reinterpret_cast<uintptr_t>(*ppBlock);
+	if (pool.mConfig.mReusePolicy == ReusePolicy::Random)
+	{
+		RecycleAllBlocks(chunk);
+	}
 
 #ifdef _DEBUG
-	printf("[SUCCESS] Index of allocated block = \t%d\nFirst free block addr =\t%p\nAddress of next free block =\t%x\n\n",
-		indexBlockAllocated,
-		(void*)(*lastElementPtr), 
-		(void*)(*(reinterpret_cast<uintptr_t*>(*ppBlock))));
+	chunk.mCallSites.assign(numBlocks, AllocationCallSite{ nullptr, 0 });
 #endif // _DEBUG
 
-	// Invalidate pointer
-	*ppBlock = nullptr;
-}
\ No newline at end of file
+	pool.mChunksByAddress[reinterpret_cast<uintptr_t>(chunk.mMemory)] = pool.mChunks.size();
+	mChunkExtents[reinterpret_cast<uintptr_t>(chunk.mMemory)] = std::make_pair(reinterpret_cast<uintptr_t>(chunk.mEnd), size);
+	pool.mChunks.push_back(std::move(chunk));
+	pool.mTotalBlocks += numBlocks;
+	pool.mActiveChunk = pool.mChunks.size() - 1;
+	UpdateChunkList(pool, pool.mActiveChunk);
+
+	return true;
+}
+
+
+inline void MemoryManager::UpdateChunkList(Pool& pool, size_t chunkIndex)
+{
+	Chunk& chunk = pool.mChunks[chunkIndex];
+	size_t liveCount = *GetLiveCount(chunk);
+	size_t list = (liveCount == 0) ? EMPTYCHUNKS : (liveCount == chunk.mNumBlocks) ? FULLCHUNKS : PARTIALCHUNKS;
+	if (chunk.mList == list)
+	{
+		return;
+	}
+
+	UnlinkChunk(pool, chunkIndex);
+
+	chunk.mList = list;
+	chunk.mPreviousChunk = SIZE_MAX;
+	chunk.mNextChunk = pool.mChunkListHeads[list];
+	if (chunk.mNextChunk != SIZE_MAX)
+	{
+		pool.mChunks[chunk.mNextChunk].mPreviousChunk = chunkIndex;
+	}
+
+	pool.mChunkListHeads[list] = chunkIndex;
+	pool.mChunkListSizes[list]++;
+}
+
+
+inline void MemoryManager::UnlinkChunk(Pool& pool, size_t chunkIndex)
+{
+	Chunk& chunk = pool.mChunks[chunkIndex];
+	if (chunk.mList == NUMCHUNKLISTS)
+	{
+		return;
+	}
+
+	if (chunk.mPreviousChunk != SIZE_MAX)
+	{
+		pool.mChunks[chunk.mPreviousChunk].mNextChunk = chunk.mNextChunk;
+	}
+	else
+	{
+		pool.mChunkListHeads[chunk.mList] = chunk.mNextChunk;
+	}
+
+	if (chunk.mNextChunk != SIZE_MAX)
+	{
+		pool.mChunks[chunk.mNextChunk].mPreviousChunk = chunk.mPreviousChunk;
+	}
+
+	pool.mChunkListSizes[chunk.mList]--;
+	chunk.mList = NUMCHUNKLISTS;
+}
+
+
+inline void MemoryManager::ReleaseChunkMemory(const Pool& pool, const Chunk& chunk)
+{
+	// Unmapping drops the lock anyway, but heap memory would stay locked after being freed
+	if (pool.mConfig.mFaultPolicy == FaultPolicy::Lock)
+	{
+		UnlockPages(chunk.mMetadata, chunk.mBytes);
+	}
+
+	ReleasePoolMemory(chunk.mMetadata, chunk.mBytes, chunk.mBacking);
+}
+
+
+inline void MemoryManager::ReleaseChunk(Pool& pool, size_t chunkIndex)
+{
+	Chunk& chunk = pool.mChunks[chunkIndex];
+	UnlinkChunk(pool, chunkIndex);
+	pool.mChunksByAddress.erase(reinterpret_cast<uintptr_t>(chunk.mMemory));
+	mChunkExtents.erase(reinterpret_cast<uintptr_t>(chunk.mMemory));
+	if (mConfig.mTrackMappedPages && chunk.mBacking != PoolBacking::Heap)
+	{
+		mMappedPages.Set(chunk.mMemory, static_cast<size_t>(chunk.mEnd - chunk.mMemory), 0);
+	}
+
+	pool.mTotalBlocks -= chunk.mNumBlocks;
+	ReleaseChunkMemory(pool, chunk);
+
+	// Move the last chunk into the hole, so no other index changes
+	size_t lastIndex = pool.mChunks.size() - 1;
+	if (chunkIndex != lastIndex)
+	{
+		UnlinkChunk(pool, lastIndex);
+		chunk = std::move(pool.mChunks[lastIndex]);
+		pool.mChunksByAddress[reinterpret_cast<uintptr_t>(chunk.mMemory)] = chunkIndex;
+	}
+
+	pool.mChunks.pop_back();
+
+	if (chunkIndex != lastIndex)
+	{
+		UpdateChunkList(pool, chunkIndex);
+	}
+
+	if (pool.mActiveChunk == lastIndex)
+	{
+		pool.mActiveChunk = chunkIndex;
+	}
+
+	if (pool.mActiveChunk >= pool.mChunks.size())
+	{
+		pool.mActiveChunk = 0;
+	}
+}
+
+
+inline size_t MemoryManager::GetHeaderBytes(size_t numBlocks)
+{
+	size_t headerBytes = 3 * sizeof(void*) + GetBitfieldWordCount(numBlocks) * sizeof(uint64_t);
+
+	// Unpadded, the header is only rounded up so the blocks after it are aligned for any type
+#if MM_PAD_METADATA
+	size_t alignment = CACHE_LINE_SIZE;
+#else
+	size_t alignment = alignof(std::max_align_t);
+#endif // MM_PAD_METADATA
+
+	return (headerBytes + alignment - 1) / alignment * alignment;
+}
+
+
+inline size_t MemoryManager::GetChunkBytes(size_t size, size_t numBlocks)
+{
+	size_t metadataBytes = GetHeaderBytes(numBlocks);
+
+	// size * numBlocks + metadataBytes must not wrap around
+	if (numBlocks > (SIZE_MAX - metadataBytes) / size)
+	{
+		return 0;
+	}
+
+	return (size * numBlocks) + metadataBytes;
+}
+
+
+inline size_t MemoryManager::GetBlocksPerSlab(size_t size, size_t slabBytes)
+{
+	// Start from the count ignoring the header and back off until the header fits too. The bitfield grows by a bit per block, so this takes few steps
+	size_t numBlocks = slabBytes / size;
+	while (numBlocks > 1 && GetChunkBytes(size, numBlocks) > slabBytes)
+	{
+		numBlocks--;
+	}
+
+	return std::max<size_t>(numBlocks, 1);
+}
+
+
+inline void MemoryManager::ResetChunk(Chunk& chunk)
+{
+	// Rather than re-threading every block, empty the free list and hand blocks out from the start of the storage again
+	*GetFreeListHead(chunk) = 0;
+	*GetFirstUntouchedBlock(chunk) = reinterpret_cast<uintptr_t>(chunk.mMemory);
+	*GetLiveCount(chunk) = 0;
+	memset(GetBitfield(chunk), 0, GetBitfieldWordCount(chunk.mNumBlocks) * sizeof(uint64_t));
+	chunk.mHandleSlots.reset();
+	chunk.mNumRecycled = 0;
+	chunk.mSearchWord = 0;
+	chunk.mPageFreeCounts.clear();
+	chunk.mCurrentPage = SIZE_MAX;
+}
+
+
+inline void MemoryManager::RecycleAllBlocks(Chunk& chunk)
+{
+	*GetFirstUntouchedBlock(chunk) = reinterpret_cast<uintptr_t>(chunk.mEnd);
+	chunk.mNumRecycled = chunk.mNumBlocks;
+}
+
+
+inline size_t MemoryManager::GetSizeClass(size_t size) const
+{
+	auto iter = mPool.lower_bound(size);
+	return iter == mPool.end() ? 0 : (*iter).first;
+}
+
+
+inline size_t MemoryManager::GetCapacity(size_t sizeClass) const
+{
+	auto iter = mPool.find(sizeClass);
+	return iter == mPool.end() ? 0 : (*iter).second.mTotalBlocks;
+}
+
+
+inline size_t MemoryManager::GetBlockSize(const void* block) const
+{
+	uintptr_t address = reinterpret_cast<uintptr_t>(block);
+
+	// Last chunk starting at or below the address, which holds it if the address is below the end of its blocks
+	auto iter = mChunkExtents.upper_bound(address);
+	if (iter == mChunkExtents.begin())
+	{
+		return 0;
+	}
+
+	const std::pair<uintptr_t, size_t>& extent = (*std::prev(iter)).second;
+	return (address < extent.first) ? extent.second : 0;
+}
+
+
+inline MemoryManager::Pool* MemoryManager::GetPool(size_t size, bool create)
+{
+	auto iter = mPool.lower_bound(size);
+	if (iter != mPool.end())
+	{
+		return &(*iter).second;
+	}
+
+	if (!create || !InitializePool(size, mConfig.mDefaults.mInitialBlocks))
+	{
+		return nullptr;
+	}
+
+	return &mPool[size];
+}
+
+
+inline MemoryManager::Chunk* MemoryManager::FindChunk(Pool& pool, const void* pointer)
+{
+	uintptr_t address = reinterpret_cast<uintptr_t>(pointer);
+
+	// Last chunk starting at or below the address. With slabs there can be many chunks, so no linear scan
+	auto iter = pool.mChunksByAddress.upper_bound(address);
+	if (iter == pool.mChunksByAddress.begin())
+	{
+		return nullptr;
+	}
+
+	Chunk& chunk = pool.mChunks[(*std::prev(iter)).second];
+	return (address < reinterpret_cast<uintptr_t>(chunk.mEnd)) ? &chunk : nullptr;
+}
+
+
+inline bool MemoryManager::MakeHandle(Pool& pool, const void* block, uint32_t& index, uint32_t& generation)
+{
+	Chunk* chunk = FindChunk(pool, block);
+	size_t blockIndex = chunk ? static_cast<size_t>(reinterpret_cast<const char*>(block) - chunk->mMemory) / pool.mConfig.mBlockSize : 0;
+	if (!chunk || (GetBitfield(*chunk)[blockIndex / NUMBITSPERWORD] & (uint64_t(1) << (blockIndex % NUMBITSPERWORD))) == 0)
+	{
+		return false;
+	}
+
+	if (!chunk->mHandleSlots)
+	{
+		chunk->mHandleSlots.reset(new uint32_t[chunk->mNumBlocks]());
+	}
+
+	uint32_t& slotOfBlock = chunk->mHandleSlots[blockIndex];
+	if (slotOfBlock == 0)
+	{
+		if (pool.mFreeHandleSlot)
+		{
+			slotOfBlock = pool.mFreeHandleSlot;
+			pool.mFreeHandleSlot = pool.mHandleSlots[slotOfBlock - 1].mNextFreeSlot;
+		}
+		else if (pool.mIssuedHandleSlots < pool.mHandleSlots.size())
+		{
+			// Slot last used before a Reset(). Its generation moves on, so handles issued back then stay stale
+			slotOfBlock = ++pool.mIssuedHandleSlots;
+			pool.mHandleSlots[slotOfBlock - 1].mGeneration++;
+		}
+		else if (pool.mHandleSlots.size() < UINT32_MAX - 1)
+		{
+			pool.mHandleSlots.emplace_back();
+			slotOfBlock = ++pool.mIssuedHandleSlots;
+		}
+		else
+		{
+			return false;
+		}
+
+		pool.mHandleSlots[slotOfBlock - 1].mBlock = const_cast<void*>(block);
+	}
+
+	index = slotOfBlock;
+	generation = pool.mHandleSlots[slotOfBlock - 1].mGeneration;
+	return true;
+}
+
+
+inline void MemoryManager::ReleaseHandleSlot(Pool& pool, uint32_t slot)
+{
+	HandleSlot& handleSlot = pool.mHandleSlots[slot - 1];
+	handleSlot.mBlock = nullptr;
+	handleSlot.mGeneration++;
+	handleSlot.mNextFreeSlot = pool.mFreeHandleSlot;
+	pool.mFreeHandleSlot = slot;
+}
+
+
+template<typename T>
+Handle<T> MemoryManager::AllocateHandle(MM_CALLSITE_ARGS)
+{
+	Handle<T> handle;
+
+	T* block = Allocate<T>(MM_CALLSITE_FORWARD);
+	if (block && !MakeHandle(*GetPool(sizeof(T), false), block, handle.mIndex, handle.mGeneration))
+	{
+		Free(&block);
+	}
+
+	return handle;
+}
+
+
+template<typename T>
+Handle<T> MemoryManager::GetHandle(const T* pointer)
+{
+	Handle<T> handle;
+
+	Pool* pool = pointer ? GetPool(sizeof(T), false) : nullptr;
+	if (pool)
+	{
+		MakeHandle(*pool, pointer, handle.mIndex, handle.mGeneration);
+	}
+
+	return handle;
+}
+
+
+template<typename T>
+T* MemoryManager::Resolve(Handle<T> handle)
+{
+	Pool* pool = handle ? GetPool(sizeof(T), false) : nullptr;
+	if (!pool || handle.mIndex > pool->mIssuedHandleSlots)
+	{
+		return nullptr;
+	}
+
+	// Generation only matches while the block is still the allocation the handle was issued for
+	const HandleSlot& slot = pool->mHandleSlots[handle.mIndex - 1];
+	return (slot.mGeneration == handle.mGeneration) ? reinterpret_cast<T*>(slot.mBlock) : nullptr;
+}
+
+
+template<typename T>
+void MemoryManager::Free(Handle<T>* handle)
+{
+	T* block = Resolve(*handle);
+	if (!block)
+	{
+#ifdef _DEBUG
+		printf("[FAILURE] Stale or null handle passed\n");
+#endif // _DEBUG
+		return;
+	}
+
+	Free(&block);
+	*handle = Handle<T>();
+}
+
+
+inline bool MemoryManager::RefillFreeList(Pool& pool)
+{
+	// Active chunk is out of recycled blocks. Switch to a chunk with free blocks, growing the pool if there is none.
+	// Partially used chunks go first, so empty ones stay empty and can be released
+	if (!HasFreeBlock(pool.mChunks[pool.mActiveChunk]))
+	{
+		size_t chunkIndex = pool.mChunkListHeads[PARTIALCHUNKS];
+		if (chunkIndex == SIZE_MAX)
+		{
+			chunkIndex = pool.mChunkListHeads[EMPTYCHUNKS];
+		}
+
+		if (chunkIndex != SIZE_MAX)
+		{
+			pool.mActiveChunk = chunkIndex;
+		}
+		else
+		{
+			const SizeClassConfig& config = pool.mConfig;
+			size_t numBlocks = (config.mGrowthPolicy == GrowthPolicy::Double) ? pool.mTotalBlocks : config.mInitialBlocks;
+			if (config.mMaxBlocks)
+			{
+				numBlocks = std::min(numBlocks, config.mMaxBlocks - pool.mTotalBlocks);
+			}
+
+			if (config.mGrowthPolicy == GrowthPolicy::None || numBlocks == 0 || !Grow(pool, numBlocks))
+			{
+				return false;
+			}
+
+#ifdef _DEBUG
+			printf("[SUCCESS] Grew pool of size class %zu by %zu blocks\n", config.mBlockSize, numBlocks);
+#endif // _DEBUG
+		}
+	}
+
+	// Carve the next untouched block and thread it as the only free block. Other reuse policies take blocks straight from the chunk
+	Chunk& chunk = pool.mChunks[pool.mActiveChunk];
+	uintptr_t* freeListHead = GetFreeListHead(chunk);
+	if (pool.mConfig.mReusePolicy == ReusePolicy::Lifo && *freeListHead == 0)
+	{
+		uintptr_t* firstUntouchedBlock = GetFirstUntouchedBlock(chunk);
+
+		*(reinterpret_cast<uintptr_t*>(*firstUntouchedBlock)) = 0;
+		*freeListHead = *firstUntouchedBlock;
+		*firstUntouchedBlock += pool.mConfig.mBlockSize;
+	}
+
+	return true;
+}
+
+
+inline void MemoryManager::Reset(size_t sizeClass)
+{
+	auto iter = mPool.find(sizeClass);
+	if (iter == mPool.end())
+	{
+		return;
+	}
+
+	// O(chunks): each chunk only has its free list head, untouched-block mark and bitfield reset.
+	// Blocks queued by other threads are free anyway after the reset, and blocks taken from upstream go back to it
+	Pool& pool = (*iter).second;
+	pool.mRemoteFreeListHead.exchange(0, std::memory_order_acquire);
+	ReleaseUpstreamBlocks(pool);
+
+	mUsedBytes.store(mUsedBytes.load(std::memory_order_relaxed) - pool.mUsedBytes, std::memory_order_relaxed);
+	pool.mUsedBytes = 0;
+
+	// Every handle goes stale at once: the handle table starts over from its first slot
+	pool.mFreeHandleSlot = 0;
+	pool.mIssuedHandleSlots = 0;
+
+	for (size_t chunkIndex = 0; chunkIndex < pool.mChunks.size(); chunkIndex++)
+	{
+		ResetChunk(pool.mChunks[chunkIndex]);
+		if (pool.mConfig.mReusePolicy == ReusePolicy::Random)
+		{
+			RecycleAllBlocks(pool.mChunks[chunkIndex]);
+		}
+
+		UpdateChunkList(pool, chunkIndex);
+	}
+
+	pool.mActiveChunk = 0;
+
+#ifdef _DEBUG
+	printf("[SUCCESS] Reset pool of size class %zu\n", sizeClass);
+#endif // _DEBUG
+}
+
+
+inline void MemoryManager::Reset()
+{
+	for (auto iter = mPool.begin(); iter != mPool.end(); ++iter)
+	{
+		Reset((*iter).first);
+	}
+}
+
+
+template<typename Callback>
+void MemoryManager::ForEachLiveInChunk(const Chunk& chunk, size_t blockSize, Callback callback)
+{
+	const uint64_t* bitfield = GetBitfield(chunk);
+	size_t numWords = GetBitfieldWordCount(chunk.mNumBlocks);
+
+	for (size_t wordIndex = 0; wordIndex < numWords; ++wordIndex)
+	{
+		// Skip 64 free blocks at a time; otherwise visit set bits lowest first, clearing each once visited
+		uint64_t word = bitfield[wordIndex];
+
+		// Fetch the first block of the next word while this one is processed
+		if (word && wordIndex + 1 < numWords && bitfield[wordIndex + 1])
+		{
+			PrefetchBlock(chunk.mMemory + ((wordIndex + 1) * NUMBITSPERWORD + CountTrailingZeros(bitfield[wordIndex + 1])) * blockSize);
+		}
+
+		while (word)
+		{
+			size_t blockIndex = wordIndex * NUMBITSPERWORD + CountTrailingZeros(word);
+			word &= word - 1;
+
+			if (word)
+			{
+				PrefetchBlock(chunk.mMemory + (wordIndex * NUMBITSPERWORD + CountTrailingZeros(word)) * blockSize);
+			}
+
+			callback(static_cast<void*>(chunk.mMemory + blockIndex * blockSize), blockIndex);
+		}
+	}
+}
+
+
+template<typename Callback>
+void MemoryManager::ForEachLive(size_t sizeClass, Callback callback)
+{
+	auto iter = mPool.find(sizeClass);
+	if (iter == mPool.end())
+	{
+		return;
+	}
+
+	// Chunks are kept in creation order; visit them by address
+	std::vector<const Chunk*> chunks;
+	for (const Chunk& chunk : (*iter).second.mChunks)
+	{
+		chunks.push_back(&chunk);
+	}
+
+	std::sort(chunks.begin(), chunks.end(), [](const Chunk* left, const Chunk* right) { return left->mMemory < right->mMemory; });
+
+	for (const Chunk* chunk : chunks)
+	{
+		ForEachLiveInChunk(*chunk, sizeClass, [&callback](void* block, size_t) { callback(block); });
+	}
+}
+
+
+inline size_t MemoryManager::CountLive(size_t sizeClass)
+{
+	size_t count = 0;
+	ForEachLive(sizeClass, [&count](void*) { ++count; });
+	return count;
+}
+
+
+template<typename T, typename Callback>
+void MemoryManager::ForEach(Callback fn)
+{
+	ForEachLive(GetSizeClass(sizeof(T)), [&fn](void* block) { fn(*reinterpret_cast<T*>(block)); });
+}
+
+
+template<typename T>
+class MemoryManager::LiveRange
+{
+public:
+
+	class Iterator
+	{
+	public:
+
+		T& operator*() const { return *mBlock; }
+		T* operator->() const { return mBlock; }
+
+		Iterator& operator++()
+		{
+			Advance();
+			return *this;
+		}
+
+		bool operator==(const Iterator& other) const { return mBlock == other.mBlock; }
+		bool operator!=(const Iterator& other) const { return mBlock != other.mBlock; }
+
+	private:
+
+		friend class LiveRange;
+
+		// Move to the next set bit, loading the next non-empty word (of this chunk or a later one) once the current one is used up
+		void Advance()
+		{
+			const std::vector<const Chunk*>& chunks = mRange->mChunks;
+			while (mWord == 0)
+			{
+				if (++mWordIndex >= GetBitfieldWordCount(chunks[mChunkIndex]->mNumBlocks))
+				{
+					mWordIndex = 0;
+					if (++mChunkIndex == chunks.size())
+					{
+						mBlock = nullptr;
+						return;
+					}
+				}
+
+				mWord = GetBitfield(*chunks[mChunkIndex])[mWordIndex];
+			}
+
+			char* memory = chunks[mChunkIndex]->mMemory;
+			size_t blockSize = mRange->mBlockSize;
+			mBlock = reinterpret_cast<T*>(memory + (mWordIndex * NUMBITSPERWORD + CountTrailingZeros(mWord)) * blockSize);
+			mWord &= mWord - 1;
+
+			if (mWord)
+			{
+				PrefetchBlock(memory + (mWordIndex * NUMBITSPERWORD + CountTrailingZeros(mWord)) * blockSize);
+			}
+		}
+
+		const LiveRange* mRange = nullptr;
+		size_t mChunkIndex = 0;
+		size_t mWordIndex = 0;
+
+		// Bits of the current word not visited yet
+		uint64_t mWord = 0;
+
+		T* mBlock = nullptr;
+	};
+
+	Iterator begin() const
+	{
+		Iterator iterator;
+		iterator.mRange = this;
+		if (!mChunks.empty())
+		{
+			iterator.mWord = GetBitfield(*mChunks[0])[0];
+			iterator.Advance();
+		}
+
+		return iterator;
+	}
+
+	Iterator end() const { return Iterator(); }
+
+private:
+
+	friend class MemoryManager;
+
+	// Chunks of the pool by address
+	std::vector<const Chunk*> mChunks;
+	size_t mBlockSize = 0;
+};
+
+
+template<typename T>
+MemoryManager::LiveRange<T> MemoryManager::Live()
+{
+	LiveRange<T> range;
+	auto iter = mPool.find(GetSizeClass(sizeof(T)));
+	if (iter == mPool.end())
+	{
+		return range;
+	}
+
+	range.mBlockSize = (*iter).first;
+	for (const Chunk& chunk : (*iter).second.mChunks)
+	{
+		range.mChunks.push_back(&chunk);
+	}
+
+	std::sort(range.mChunks.begin(), range.mChunks.end(), [](const Chunk* left, const Chunk* right) { return left->mMemory < right->mMemory; });
+
+	return range;
+}
+
+
+inline size_t MemoryManager::ReportLeaks()
+{
+	size_t totalLeaked = 0;
+
+	for (auto iter = mPool.begin(); iter != mPool.end(); ++iter)
+	{
+		size_t sizeClass = (*iter).first;
+		size_t leaked = CountLive(sizeClass) + (*iter).second.mUpstreamBlocks.size();
+		if (leaked == 0)
+		{
+			continue;
+		}
+
+		printf("[LEAK] Size class %zu: %zu block(s) still allocated\n", sizeClass, leaked);
+
+#ifdef _DEBUG
+		for (const Chunk& chunk : (*iter).second.mChunks)
+		{
+			ForEachLiveInChunk(chunk, sizeClass, [&chunk](void* block, size_t blockIndex)
+				{
+					const AllocationCallSite& callSite = chunk.mCallSites[blockIndex];
+					printf("\t%p allocated at %s:%d\n", block, callSite.mFile ? callSite.mFile : "?", callSite.mLine);
+				});
+		}
+#endif // _DEBUG
+
+		totalLeaked += leaked;
+	}
+
+	return totalLeaked;
+}
+
+
+template<typename T>
+T* MemoryManager::Allocate(MM_CALLSITE_ARGS)
+{
+	Pool* pool = GetPool(sizeof(T), true);
+	if (!pool)
+	{
+		return nullptr;
+	}
+
+	return reinterpret_cast<T*>(AllocateWithinBudget(*pool, MM_CALLSITE));
+}
+
+
+inline void* MemoryManager::AllocateBlock(Pool& pool, const AllocationCallSite& callSite)
+{
+	size_t dataTypeSize = pool.mConfig.mBlockSize;
+
+	// Address-ordered reuse: no free list to pop, the block comes out of the bitfield
+	if (pool.mConfig.mReusePolicy != ReusePolicy::Lifo)
+	{
+		if (!HasFreeBlock(pool.mChunks[pool.mActiveChunk]))
+		{
+			DrainRemoteFrees(pool);
+			if (!RefillFreeList(pool))
+			{
+				return AllocateOnExhaustion(pool, callSite);
+			}
+		}
+
+		Chunk& activeChunk = pool.mChunks[pool.mActiveChunk];
+		void* block = TakeBlock(pool, activeChunk);
+
+#ifdef _DEBUG
+		activeChunk.mCallSites[(reinterpret_cast<char*>(block) - activeChunk.mMemory) / dataTypeSize] = callSite;
+		printf("\n[SUCCESS] Allocating block at\t= %p\n", block);
+#else
+		(void)callSite;
+#endif // _DEBUG
+
+		return block;
+	}
+
+	// First grab the address of the first free available block where we can store our value.
+    // This address is stored after the last block in the active chunk
+	Chunk* chunk = &pool.mChunks[pool.mActiveChunk];
+	uintptr_t* lastElementPtr = GetFreeListHead(*chunk);
+
+	// Free list is empty: take back blocks freed by other threads, then an untouched block, or move on to another chunk
+	if (*lastElementPtr == 0)
+	{
+		DrainRemoteFrees(pool);
+
+		// Then check if pool is full
+		if (!RefillFreeList(pool))
+		{
+			return AllocateOnExhaustion(pool, callSite);
+		}
+
+		chunk = &pool.mChunks[pool.mActiveChunk];
+		lastElementPtr = GetFreeListHead(*chunk);
+	}
+
+	uintptr_t firstFreeBlockAddressValue = *lastElementPtr;
+
+	// Read the link to the next free block up front and prefetch that block: it is the head the next Allocate() pops,
+	// so its own link is in cache by then, even when the free list jumps all over the pool
+	uintptr_t nextFreeBlockAddressValue = *(reinterpret_cast<uintptr_t*>(firstFreeBlockAddressValue));
+#if MM_PREFETCH_FREE_LIST
+	PrefetchBlock(reinterpret_cast<const void*>(nextFreeBlockAddressValue));
+#endif // MM_PREFETCH_FREE_LIST
+
+	// Need to mark this block as allocated by setting the correct bit in the allocation-tracking bitfield.
+	size_t indexBlockAllocated = (firstFreeBlockAddressValue - reinterpret_cast<uintptr_t>(chunk->mMemory)) / dataTypeSize;
+	uint64_t* desiredWord = GetBitfield(*chunk) + (indexBlockAllocated / NUMBITSPERWORD);
+	*(desiredWord) |= (uint64_t(1) << (indexBlockAllocated % NUMBITSPERWORD));
+
+	// Chunk moves lists on its first and last allocation
+	size_t liveCount = ++*GetLiveCount(*chunk);
+	if (liveCount == 1 || liveCount == chunk->mNumBlocks)
+	{
+		UpdateChunkList(pool, pool.mActiveChunk);
+	}
+
+
+#ifdef _DEBUG
+	chunk->mCallSites[indexBlockAllocated] = callSite;
+
+	printf("\n[SUCCESS] Index of allocated block\t= %zu\nAddress of desired word\t= %p\nWord after setting status\t= %llx\nAllocating block at\t= %p\n",
+			indexBlockAllocated,
+			(void*)desiredWord,
+			(unsigned long long)(*desiredWord),
+			(void*)firstFreeBlockAddressValue
+		);
+#else
+	(void)callSite;
+#endif // _DEBUG
+
+	uintptr_t temp = firstFreeBlockAddressValue;
+
+	// The value in this free block is the next available free block - which will now become the first free block
+	firstFreeBlockAddressValue = nextFreeBlockAddressValue;
+
+	*lastElementPtr = firstFreeBlockAddressValue;
+
+#ifdef _DEBUG
+	printf("Next block from first free block =\t%p\n\n", (void*)firstFreeBlockAddressValue);
+#endif // _DEBUG
+
+	// Using temp since firstFreeBlockAddressValue got updated
+	return reinterpret_cast<void*>(temp);
+}
+
+
+template<typename T>
+void MemoryManager::Free(T** ppBlock)
+{
+	if (Free(static_cast<void*>(*ppBlock), sizeof(T)))
+	{
+		// Invalidate pointer
+		*ppBlock = nullptr;
+	}
+}
+
+
+inline void* MemoryManager::Allocate(size_t size MM_CALLSITE_EXTRA_ARGS)
+{
+	Pool* pool = GetPool(size, true);
+	if (!pool)
+	{
+		return nullptr;
+	}
+
+	return AllocateWithinBudget(*pool, MM_CALLSITE);
+}
+
+
+inline void* MemoryManager::TryAllocate(size_t size MM_CALLSITE_EXTRA_ARGS)
+{
+	// The flag is only read once the pool is exhausted, so the allocation path itself pays nothing for it.
+	// bad_alloc can still come from creating the pool, hence the catch
+	mSkipExhaustionPolicy = true;
+
+	void* block;
+	try
+	{
+		block = Allocate(size MM_CALLSITE_EXTRA_FORWARD);
+	}
+	catch (const std::bad_alloc&)
+	{
+		block = nullptr;
+	}
+
+	mSkipExhaustionPolicy = false;
+	return block;
+}
+
+
+template<typename Rep, typename Period>
+void* MemoryManager::Allocate(size_t size, const std::chrono::duration<Rep, Period>& timeout MM_CALLSITE_EXTRA_ARGS)
+{
+	Pool* pool = GetPool(size, true);
+	if (!pool)
+	{
+		return nullptr;
+	}
+
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout);
+	for (;;)
+	{
+		void* block = AllocateWithinBudget(*pool, MM_CALLSITE);
+		if (block || std::chrono::steady_clock::now() >= deadline)
+		{
+			return block;
+		}
+
+		// Only frees from other threads can make room while the owner is blocked here. The attempt above drains only the target pool
+		// unless the budget is used up, so take back the queued blocks of every pool first: otherwise a block queued for another pool
+		// would keep the wait below from sleeping until the deadline. Blocks that came back may have made room, so try again first
+		if (DrainRemoteFrees() != 0)
+		{
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(mFreeWaitMutex);
+		mFreeWaiters.fetch_add(1);
+		mFreeCondition.wait_until(lock, deadline, [this] { return HasRemoteFrees(); });
+		mFreeWaiters.fetch_sub(1);
+	}
+}
+
+
+inline bool MemoryManager::HasBudgetFor(const Pool& pool) const
+{
+	size_t blockSize = pool.mConfig.mBlockSize;
+	return (mBudgetBytes == 0 || mUsedBytes.load(std::memory_order_relaxed) + blockSize <= mBudgetBytes)
+		&& (pool.mConfig.mQuotaBytes == 0 || pool.mUsedBytes + blockSize <= pool.mConfig.mQuotaBytes);
+}
+
+
+inline void* MemoryManager::AllocateWithinBudget(Pool& pool, const AllocationCallSite& callSite)
+{
+	if (!HasBudgetFor(pool))
+	{
+		// Blocks other threads freed still count until they are drained
+		DrainRemoteFrees();
+		if (!HasBudgetFor(pool))
+		{
+#ifdef _DEBUG
+			printf("[FAILURE] Memory budget or quota of size class %zu exceeded!\n", pool.mConfig.mBlockSize);
+#endif // _DEBUG
+			return nullptr;
+		}
+	}
+
+	void* block = AllocateBlock(pool, callSite);
+	if (block)
+	{
+		pool.mUsedBytes += pool.mConfig.mBlockSize;
+		mUsedBytes.store(mUsedBytes.load(std::memory_order_relaxed) + pool.mConfig.mBlockSize, std::memory_order_relaxed);
+	}
+
+	return block;
+}
+
+
+inline bool MemoryManager::HasRemoteFrees() const
+{
+	for (auto iter = mPool.begin(); iter != mPool.end(); ++iter)
+	{
+		if ((*iter).second.mRemoteFreeListHead.load(std::memory_order_seq_cst) != 0)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+inline bool MemoryManager::SetQuota(size_t sizeClass, size_t bytes)
+{
+	auto iter = mPool.find(sizeClass);
+	if (iter == mPool.end())
+	{
+		return false;
+	}
+
+	(*iter).second.mConfig.mQuotaBytes = bytes;
+	return true;
+}
+
+
+inline size_t MemoryManager::GetUsedBytes(size_t sizeClass) const
+{
+	auto iter = mPool.find(sizeClass);
+	return iter == mPool.end() ? 0 : (*iter).second.mUsedBytes;
+}
+
+
+inline void* MemoryManager::AllocateTagged(size_t size, MemoryTag& tag, const AllocationCallSite& callSite)
+{
+	Pool* pool = GetPool(size, true);
+	if (!pool)
+	{
+		return nullptr;
+	}
+
+	size_t blockSize = pool->mConfig.mBlockSize;
+	if (tag.mQuotaBytes && tag.GetLiveBytes() + blockSize > tag.mQuotaBytes)
+	{
+#ifdef _DEBUG
+		printf("[FAILURE] Quota of tag %s exceeded!\n", tag.mName);
+#endif // _DEBUG
+		return nullptr;
+	}
+
+	void* block = AllocateWithinBudget(*pool, callSite);
+	if (block)
+	{
+		tag.mAllocatedBytes.store(tag.mAllocatedBytes.load(std::memory_order_relaxed) + blockSize, std::memory_order_release);
+	}
+
+	return block;
+}
+
+
+inline bool MemoryManager::FreeTagged(void* block, size_t size, MemoryTag& tag)
+{
+	Pool* pool = block ? GetPool(size, false) : nullptr;
+	if (!pool || !FreeToPool(*pool, block))
+	{
+		return false;
+	}
+
+	size_t blockSize = pool->mConfig.mBlockSize;
+	if (std::this_thread::get_id() == mOwnerThread)
+	{
+		tag.mFreedBytes.store(tag.mFreedBytes.load(std::memory_order_relaxed) + blockSize, std::memory_order_release);
+	}
+	else
+	{
+		tag.mRemoteFreedBytes.fetch_add(blockSize, std::memory_order_release);
+	}
+
+	return true;
+}
+
+
+inline MemoryTagStats MemoryManager::GetTagStats(const MemoryTag& tag)
+{
+	MemoryTagStats stats;
+	stats.mTag = tag.mName;
+	stats.mFreedBytes = tag.GetFreedBytes();
+	stats.mAllocatedBytes = tag.mAllocatedBytes.load(std::memory_order_acquire);
+	stats.mLiveBytes = stats.mAllocatedBytes - stats.mFreedBytes;
+	stats.mQuotaBytes = tag.mQuotaBytes;
+	return stats;
+}
+
+
+inline std::vector<MemoryTagStats> MemoryManager::GetTagStats() const
+{
+	std::vector<MemoryTagStats> stats;
+	for (const MemoryTag* tag : mTags)
+	{
+		stats.push_back(GetTagStats(*tag));
+	}
+
+	return stats;
+}
+
+
+inline bool MemoryManager::Free(void* block, size_t size)
+{
+#ifdef _DEBUG
+	printf("Attempting to free memory at address = %p\n", block);
+#endif // _DEBUG
+
+	if (block == nullptr)
+	{
+#ifdef _DEBUG
+		printf("[FAILURE]Invalid pointer passed\n");
+#endif // _DEBUG
+		return false;
+	}
+
+	Pool* pool = GetPool(size, false);
+	if (!pool)
+	{
+		return false;
+	}
+
+	return FreeToPool(*pool, block);
+}
+
+
+inline bool MemoryManager::FreeToPool(Pool& pool, void* block)
+{
+	// Owner thread has the pool to itself. Checks (double free, foreign pointer) on queued blocks happen when the owner drains them
+	if (std::this_thread::get_id() != mOwnerThread)
+	{
+		PushRemoteFree(pool, block);
+
+		// Wake an owner waiting in Allocate() with a timeout. The push and this load are both sequentially consistent, so either the waiter
+		// sees the block or the load sees the waiter
+		if (mFreeWaiters.load(std::memory_order_seq_cst) != 0)
+		{
+			std::lock_guard<std::mutex> lock(mFreeWaitMutex);
+			mFreeCondition.notify_all();
+		}
+
+		return true;
+	}
+
+	return FreeBlock(pool, block);
+}
+
+
+inline void* MemoryManager::Reallocate(void* block, size_t oldSize, size_t newSize MM_CALLSITE_EXTRA_ARGS)
+{
+	if (block == nullptr)
+	{
+		return Allocate(newSize MM_CALLSITE_EXTRA_FORWARD);
+	}
+
+	// Still fits its size class. Moving to a smaller class is not skipped: Free() must find the block in the pool for newSize
+	Pool* pool = GetPool(oldSize, false);
+	if (pool && pool == GetPool(newSize, false))
+	{
+		return block;
+	}
+
+	void* newBlock = Allocate(newSize MM_CALLSITE_EXTRA_FORWARD);
+	if (!newBlock)
+	{
+		return nullptr;
+	}
+
+	memcpy(newBlock, block, std::min(oldSize, newSize));
+	Free(block, oldSize);
+	return newBlock;
+}
+
+
+inline void* MemoryManager::AllocateOnExhaustion(Pool& pool, const AllocationCallSite& callSite)
+{
+#ifdef _DEBUG
+	printf("[FAILURE] Pool exhausted!\n\n");
+#endif // _DEBUG
+
+	if (mSkipExhaustionPolicy)
+	{
+		return nullptr;
+	}
+
+	switch (pool.mConfig.mExhaustionPolicy)
+	{
+	case ExhaustionPolicy::Grow:
+		// Past the growth policy and block limit. The new chunk becomes the active one, so the retry cannot come back here
+		if (Grow(pool, std::max<size_t>(pool.mConfig.mInitialBlocks, 1)))
+		{
+			return AllocateBlock(pool, callSite);
+		}
+		break;
+
+	case ExhaustionPolicy::Throw:
+		throw std::bad_alloc();
+
+	case ExhaustionPolicy::Handler:
+		while (mExhaustionHandler && mExhaustionHandler(pool.mConfig.mBlockSize))
+		{
+			DrainRemoteFrees(pool);
+			if (RefillFreeList(pool))
+			{
+				return AllocateBlock(pool, callSite);
+			}
+		}
+		break;
+
+	case ExhaustionPolicy::Upstream:
+	{
+		void* block = mUpstreamAllocate ? mUpstreamAllocate(pool.mConfig.mBlockSize) : nullptr;
+		if (block)
+		{
+			pool.mUpstreamBlocks.insert(block);
+		}
+		return block;
+	}
+
+	case ExhaustionPolicy::ReturnNull:
+		break;
+	}
+
+	return nullptr;
+}
+
+
+inline void MemoryManager::ReleaseUpstreamBlocks(Pool& pool)
+{
+	for (void* block : pool.mUpstreamBlocks)
+	{
+		mUpstreamFree(block);
+	}
+
+	pool.mUpstreamBlocks.clear();
+}
+
+
+inline bool MemoryManager::FreeBlock(Pool& pool, void* block)
+{
+	size_t dataTypeSize = pool.mConfig.mBlockSize;
+
+	Chunk* chunk = FindChunk(pool, block);
+
+	// Pointer does not belong to this pool, or does not point at the start of a block
+	size_t blockOffset = chunk ? static_cast<size_t>(reinterpret_cast<char*>(block) - chunk->mMemory) : 0;
+	if (!chunk || (blockOffset % dataTypeSize) != 0)
+	{
+		// Outside every chunk, so possibly a block the pool took from upstream once it ran out
+		if (!chunk && !pool.mUpstreamBlocks.empty() && pool.mUpstreamBlocks.erase(block))
+		{
+			mUpstreamFree(block);
+			pool.mUsedBytes -= dataTypeSize;
+			mUsedBytes.store(mUsedBytes.load(std::memory_order_relaxed) - dataTypeSize, std::memory_order_relaxed);
+			return true;
+		}
+
+#ifdef _DEBUG
+		printf("[FAILURE] Pointer is not from this pool!\n");
+#endif // _DEBUG
+
+		return false;
+	}
+
+	size_t indexBlockAllocated = blockOffset / dataTypeSize;
+	uint64_t* desiredWord = GetBitfield(*chunk) + (indexBlockAllocated / NUMBITSPERWORD);
+	uint64_t statusMask = uint64_t(1) << (indexBlockAllocated % NUMBITSPERWORD);
+
+	// If bit at the ith index of the bitfield
+	// which denotes allocation status of ith block. If already 0, we're trying to do a double free
+	if ((*desiredWord & statusMask) == 0)
+	{
+#ifdef _DEBUG
+		printf("[FAILURE] Attempting a double free!\n");
+#endif // _DEBUG
+
+		return false;
+	}
+
+	// Outstanding handles to this block are stale from now on
+	if (chunk->mHandleSlots && chunk->mHandleSlots[indexBlockAllocated])
+	{
+		ReleaseHandleSlot(pool, chunk->mHandleSlots[indexBlockAllocated]);
+		chunk->mHandleSlots[indexBlockAllocated] = 0;
+	}
+
+	ReleaseBlock(pool, *chunk, indexBlockAllocated);
+	pool.mUsedBytes -= dataTypeSize;
+	mUsedBytes.store(mUsedBytes.load(std::memory_order_relaxed) - dataTypeSize, std::memory_order_relaxed);
+
+#ifdef _DEBUG
+	uintptr_t* lastElementPtr = GetFreeListHead(*chunk);
+	printf("[SUCCESS] Index of allocated block = \t%zu\nFirst free block addr =\t%p\nAddress of next free block =\t%p\n\n",
+		indexBlockAllocated,
+		(void*)(*lastElementPtr),
+		(void*)(*(reinterpret_cast<uintptr_t*>(block))));
+#endif // _DEBUG
+
+	// Slabs left empty go back to the OS. One spare is kept so a pool hovering around a slab boundary does not map and unmap on every call.
+	// Pre-faulted pools keep them all: Free() must not call into the OS, and the pages would fault again once mapped anew
+	size_t chunkIndex = static_cast<size_t>(chunk - pool.mChunks.data());
+	if (pool.mConfig.mSlabBytes && pool.mConfig.mFaultPolicy == FaultPolicy::Lazy && chunk->mList == EMPTYCHUNKS && pool.mChunkListSizes[EMPTYCHUNKS] > 1 && chunkIndex != pool.mActiveChunk)
+	{
+		ReleaseChunk(pool, chunkIndex);
+	}
+
+	return true;
+}
+
+
+inline void MemoryManager::PushRemoteFree(Pool& pool, void* block)
+{
+	uintptr_t* next = reinterpret_cast<uintptr_t*>(block);
+	uintptr_t head = pool.mRemoteFreeListHead.load(std::memory_order_relaxed);
+
+	do
+	{
+		*next = head;
+	} while (!pool.mRemoteFreeListHead.compare_exchange_weak(head, reinterpret_cast<uintptr_t>(block), std::memory_order_seq_cst, std::memory_order_relaxed));
+}
+
+
+inline size_t MemoryManager::DrainRemoteFrees(Pool& pool)
+{
+	// Cheap check first, so pools nobody frees into remotely cost no read-modify-write
+	if (pool.mRemoteFreeListHead.load(std::memory_order_relaxed) == 0)
+	{
+		return 0;
+	}
+
+	uintptr_t block = pool.mRemoteFreeListHead.exchange(0, std::memory_order_acquire);
+
+	size_t drained = 0;
+	while (block)
+	{
+		uintptr_t next = *(reinterpret_cast<uintptr_t*>(block));
+		if (FreeBlock(pool, reinterpret_cast<void*>(block)))
+		{
+			drained++;
+		}
+
+		block = next;
+	}
+
+	return drained;
+}
+
+
+inline size_t MemoryManager::DrainRemoteFrees()
+{
+	size_t drained = 0;
+	for (auto iter = mPool.begin(); iter != mPool.end(); ++iter)
+	{
+		drained += DrainRemoteFrees((*iter).second);
+	}
+
+	return drained;
+}
+
+
+inline void* MemoryManager::TakeBlock(Pool& pool, Chunk& chunk)
+{
+	size_t blockSize = pool.mConfig.mBlockSize;
+	uintptr_t* freeListHead = GetFreeListHead(chunk);
+	uintptr_t* firstUntouchedBlock = GetFirstUntouchedBlock(chunk);
+	size_t numTouched = (*firstUntouchedBlock - reinterpret_cast<uintptr_t>(chunk.mMemory)) / blockSize;
+	size_t blockIndex = 0;
+
+	if (*freeListHead)
+	{
+		uintptr_t block = *freeListHead;
+		*freeListHead = *(reinterpret_cast<uintptr_t*>(block));
+		blockIndex = (block - reinterpret_cast<uintptr_t>(chunk.mMemory)) / blockSize;
+	}
+	else if (chunk.mNumRecycled && pool.mConfig.mReusePolicy == ReusePolicy::Random)
+	{
+		blockIndex = FindRandomFreeBlock(pool, chunk);
+		chunk.mNumRecycled--;
+	}
+	else if (chunk.mNumRecycled && pool.mConfig.mReusePolicy == ReusePolicy::LowestAddress)
+	{
+		// Every word below the search word is full, so the scan only ever moves forward between frees
+		blockIndex = FindFreeBlock(chunk, chunk.mSearchWord * NUMBITSPERWORD, numTouched);
+		chunk.mSearchWord = blockIndex / NUMBITSPERWORD;
+		chunk.mNumRecycled--;
+	}
+	else if (chunk.mNumRecycled)
+	{
+		// Stay on the current page until it is full, then move to the page with the fewest free blocks left
+		if (chunk.mCurrentPage == SIZE_MAX || chunk.mPageFreeCounts[chunk.mCurrentPage] == 0)
+		{
+			uint32_t fewestFree = UINT32_MAX;
+			for (size_t page = 0; page < chunk.mPageFreeCounts.size(); page++)
+			{
+				if (chunk.mPageFreeCounts[page] && chunk.mPageFreeCounts[page] < fewestFree)
+				{
+					fewestFree = chunk.mPageFreeCounts[page];
+					chunk.mCurrentPage = page;
+				}
+			}
+		}
+
+		size_t blocksPerPage = GetBlocksPerPage(blockSize);
+		size_t pageStart = chunk.mCurrentPage * blocksPerPage;
+		blockIndex = FindFreeBlock(chunk, pageStart, std::min(pageStart + blocksPerPage, numTouched));
+		chunk.mPageFreeCounts[chunk.mCurrentPage]--;
+		chunk.mNumRecycled--;
+	}
+	else if (*firstUntouchedBlock != reinterpret_cast<uintptr_t>(chunk.mEnd))
+	{
+		blockIndex = numTouched;
+		*firstUntouchedBlock += blockSize;
+	}
+	else
+	{
+		return nullptr;
+	}
+
+	GetBitfield(chunk)[blockIndex / NUMBITSPERWORD] |= (uint64_t(1) << (blockIndex % NUMBITSPERWORD));
+	++*GetLiveCount(chunk);
+	UpdateChunkList(pool, static_cast<size_t>(&chunk - pool.mChunks.data()));
+
+	return chunk.mMemory + blockIndex * blockSize;
+}
+
+
+inline void MemoryManager::ReleaseBlock(Pool& pool, Chunk& chunk, size_t blockIndex)
+{
+	GetBitfield(chunk)[blockIndex / NUMBITSPERWORD] &= ~(uint64_t(1) << (blockIndex % NUMBITSPERWORD));
+	--*GetLiveCount(chunk);
+	UpdateChunkList(pool, static_cast<size_t>(&chunk - pool.mChunks.data()));
+
+	ReusePolicy reusePolicy = pool.mConfig.mReusePolicy;
+	if (reusePolicy == ReusePolicy::Lifo)
+	{
+		// Location of the freed block will now hold the address value of the previous first free block, and become the first free block
+		uintptr_t block = reinterpret_cast<uintptr_t>(chunk.mMemory + blockIndex * pool.mConfig.mBlockSize);
+		*(reinterpret_cast<uintptr_t*>(block)) = *GetFreeListHead(chunk);
+		*GetFreeListHead(chunk) = block;
+		return;
+	}
+
+	chunk.mNumRecycled++;
+
+	if (reusePolicy == ReusePolicy::LowestAddress)
+	{
+		chunk.mSearchWord = std::min(chunk.mSearchWord, blockIndex / NUMBITSPERWORD);
+
+		// Lower chunks take precedence too
+		size_t chunkIndex = static_cast<size_t>(&chunk - pool.mChunks.data());
+		pool.mActiveChunk = std::min(pool.mActiveChunk, chunkIndex);
+	}
+	else if (reusePolicy == ReusePolicy::FullestPage)
+	{
+		if (chunk.mPageFreeCounts.empty())
+		{
+			size_t blocksPerPage = GetBlocksPerPage(pool.mConfig.mBlockSize);
+			chunk.mPageFreeCounts.assign((chunk.mNumBlocks + blocksPerPage - 1) / blocksPerPage, 0);
+		}
+
+		chunk.mPageFreeCounts[blockIndex / GetBlocksPerPage(pool.mConfig.mBlockSize)]++;
+	}
+}
+
+
+inline size_t MemoryManager::FindFreeBlock(const Chunk& chunk, size_t begin, size_t end)
+{
+	const uint64_t* bitfield = GetBitfield(chunk);
+
+	for (size_t wordIndex = begin / NUMBITSPERWORD; wordIndex * NUMBITSPERWORD < end; wordIndex++)
+	{
+		// Free blocks of the word within [begin, end)
+		uint64_t freeBits = ~bitfield[wordIndex];
+		if (wordIndex == begin / NUMBITSPERWORD)
+		{
+			freeBits &= ~uint64_t(0) << (begin % NUMBITSPERWORD);
+		}
+
+		if (end - wordIndex * NUMBITSPERWORD < NUMBITSPERWORD)
+		{
+			freeBits &= (uint64_t(1) << (end % NUMBITSPERWORD)) - 1;
+		}
+
+		if (freeBits)
+		{
+			return wordIndex * NUMBITSPERWORD + CountTrailingZeros(freeBits);
+		}
+	}
+
+	return end;
+}
+
+
+inline size_t MemoryManager::FindRandomFreeBlock(Pool& pool, Chunk& chunk)
+{
+	const uint64_t* bitfield = GetBitfield(chunk);
+	size_t numWords = GetBitfieldWordCount(chunk.mNumBlocks);
+	uint64_t random = NextRandom(pool.mRandomState);
+
+	// Random word of the window, moving on to the next word (wrapping around the chunk) while it has no free block.
+	// The window follows the blocks handed out, so live blocks stay within a few cache lines of bitfield and a few pages of storage
+	size_t wordIndex = (chunk.mSearchWord + static_cast<size_t>(random % RANDOM_REUSE_WINDOW_WORDS)) % numWords;
+	uint64_t freeBits = 0;
+	for (;;)
+	{
+		freeBits = ~bitfield[wordIndex];
+		if (wordIndex == numWords - 1 && (chunk.mNumBlocks % NUMBITSPERWORD) != 0)
+		{
+			freeBits &= (uint64_t(1) << (chunk.mNumBlocks % NUMBITSPERWORD)) - 1;
+		}
+
+		if (freeBits)
+		{
+			break;
+		}
+
+		wordIndex = (wordIndex + 1 == numWords) ? 0 : wordIndex + 1;
+	}
+
+	chunk.mSearchWord = wordIndex;
+
+	// Random free block of the word: the first one at or after a random bit, wrapping around the word
+	unsigned int rotation = static_cast<unsigned int>(random >> 58);
+	uint64_t rotatedBits = (freeBits >> rotation) | (freeBits << ((NUMBITSPERWORD - rotation) % NUMBITSPERWORD));
+	return wordIndex * NUMBITSPERWORD + (CountTrailingZeros(rotatedBits) + rotation) % NUMBITSPERWORD;
+}
+
+
+template<typename MoveCallback>
+size_t MemoryManager::Compact(size_t sizeClass, MoveCallback move, size_t maxMoves)
+{
+	auto iter = mPool.find(sizeClass);
+	if (iter == mPool.end())
+	{
+		return 0;
+	}
+
+	Pool& pool = (*iter).second;
+
+	// Blocks queued by other threads may sit in chunks about to be released
+	DrainRemoteFrees(pool);
+
+	// Densest chunks first. Those that together can hold every live block are targets, the rest get emptied
+	std::vector<std::pair<size_t, Chunk*>> chunksByLiveCount;
+	size_t totalLive = 0;
+	for (Chunk& chunk : pool.mChunks)
+	{
+		size_t live = *GetLiveCount(chunk);
+		chunksByLiveCount.push_back(std::make_pair(live, &chunk));
+		totalLive += live;
+	}
+
+	std::sort(chunksByLiveCount.begin(), chunksByLiveCount.end(),
+		[](const std::pair<size_t, Chunk*>& left, const std::pair<size_t, Chunk*>& right) { return left.first > right.first; });
+
+	size_t numTargets = 0;
+	size_t targetCapacity = 0;
+	while (numTargets < chunksByLiveCount.size() && (numTargets == 0 || targetCapacity < totalLive))
+	{
+		targetCapacity += chunksByLiveCount[numTargets++].second->mNumBlocks;
+	}
+
+	size_t moved = 0;
+	size_t targetIndex = 0;
+	std::vector<char*> emptiedChunks;
+
+	// Sparsest sources first: they take the fewest moves to empty
+	for (size_t sourceIndex = chunksByLiveCount.size(); sourceIndex-- > numTargets && moved < maxMoves; )
+	{
+		Chunk& source = *chunksByLiveCount[sourceIndex].second;
+
+		ForEachLiveInChunk(source, sizeClass, [&](void* block, size_t blockIndex)
+			{
+				if (moved == maxMoves)
+				{
+					return;
+				}
+
+				void* destination = nullptr;
+				while (!destination && targetIndex < numTargets)
+				{
+					destination = TakeBlock(pool, *chunksByLiveCount[targetIndex].second);
+					targetIndex += (destination == nullptr);
+				}
+
+				if (!destination)
+				{
+					return;
+				}
+
+				Chunk& target = *chunksByLiveCount[targetIndex].second;
+				size_t destinationIndex = (reinterpret_cast<char*>(destination) - target.mMemory) / sizeClass;
+
+				move(destination, block);
+
+				// Hand the block's handle slot over to its new home, then free the old block without touching the slot
+				if (source.mHandleSlots && source.mHandleSlots[blockIndex])
+				{
+					if (!target.mHandleSlots)
+					{
+						target.mHandleSlots.reset(new uint32_t[target.mNumBlocks]());
+					}
+
+					uint32_t slot = source.mHandleSlots[blockIndex];
+					pool.mHandleSlots[slot - 1].mBlock = destination;
+					target.mHandleSlots[destinationIndex] = slot;
+					source.mHandleSlots[blockIndex] = 0;
+				}
+
+#ifdef _DEBUG
+				target.mCallSites[destinationIndex] = source.mCallSites[blockIndex];
+#endif // _DEBUG
+
+				ReleaseBlock(pool, source, blockIndex);
+				moved++;
+			});
+	}
+
+	// Release every chunk left without live blocks, keeping at least one
+	for (size_t sourceIndex = chunksByLiveCount.size(); sourceIndex-- > 1; )
+	{
+		Chunk& chunk = *chunksByLiveCount[sourceIndex].second;
+		if (*GetLiveCount(chunk) == 0)
+		{
+			emptiedChunks.push_back(chunk.mMemory);
+		}
+	}
+
+	for (char* memory : emptiedChunks)
+	{
+		ReleaseChunk(pool, pool.mChunksByAddress[reinterpret_cast<uintptr_t>(memory)]);
+	}
+
+	pool.mActiveChunk = 0;
+
+#ifdef _DEBUG
+	printf("[SUCCESS] Compacted pool of size class %zu: moved %zu blocks, released %zu chunks\n", sizeClass, moved, emptiedChunks.size());
+#endif // _DEBUG
+
+	return moved;
+}
+
+
+template<typename T>
+size_t MemoryManager::Compact(size_t maxMoves)
+{
+	size_t sizeClass = GetSizeClass(sizeof(T));
+
+	return Compact(sizeClass, [](void* destination, void* source)
+		{
+			if (std::is_trivially_copyable<T>::value)
+			{
+				memcpy(destination, source, sizeof(T));
+			}
+			else
+			{
+				T* object = reinterpret_cast<T*>(source);
+				new (destination) T(std::move(*object));
+				object->~T();
+			}
+		}, maxMoves);
+}
@@ -0,0 +1,435 @@
+/* =========================================================================================
+*
+*	Class:		Memory Manager Config
+*	Purpose:	Size classes and per-pool settings for the Memory Manager
+*	Author:		Sreyash (Srey) Raychaudhuri
+*	Date:		12/22/2024
+*
+* ==========================================================================================
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+// What a pool does once every block in it is allocated
+enum class GrowthPolicy
+{
+	None,		// Allocate() returns nullptr
+	Linear,		// Add a chunk as large as the initial one
+	Double		// Add a chunk as large as the whole pool so far
+};
+
+// Where the memory of a pool comes from
+enum class PoolBacking
+{
+	Auto,		// Heap for small chunks, OS mapping for chunks of at least OS_ALLOCATION_THRESHOLD bytes
+	Heap,		// Cache-line aligned heap allocation
+	Mmap,		// Anonymous mapping (VirtualAlloc on Windows), zero-filled and backed on first touch
+	HugePages	// Anonymous mapping on huge pages. Falls back to regular pages if none are available
+};
+
+// Which free block a pool hands out next
+enum class ReusePolicy
+{
+	Lifo,			// Most recently freed block, which is likely still in cache
+	LowestAddress,	// Free block with the lowest address, so live blocks stay packed at the start of the pool
+	FullestPage,	// Free block on the page with the fewest free blocks, so sparse pages drain and live blocks share pages
+	Random			// Free block drawn at random from a window of nearby ones, untouched blocks included, so heap layouts are hard to predict
+};
+
+// What Allocate() does once a pool is exhausted and its growth policy (or block limit) lets it grow no further
+enum class ExhaustionPolicy
+{
+	ReturnNull,		// Return nullptr
+	Grow,			// Add a chunk as large as the initial one anyway
+	Throw,			// Throw std::bad_alloc
+	Handler,		// Call the exhaustion handler of the manager, and retry while it asks to
+	Upstream		// Take the block from the upstream allocator of the manager. Free() hands it back there
+};
+
+// When the pages of a pool get backed by physical memory. With Prefault or Lock, a release build whose pools cannot grow
+// (GrowthPolicy::None) makes no system call and no heap allocation in Allocate() or Free() once each pool has been through one
+// allocate / free cycle, as long as every size allocated has a pool and no handles are taken
+enum class FaultPolicy
+{
+	Lazy,		// On first touch of each page
+	Prefault,	// All at once when a chunk is added, so blocks never fault on first touch. Empty slabs are kept rather than released
+	Lock		// As Prefault, and locked in physical memory (mlock / VirtualLock) so they are never paged out. Fails if the lock limit is hit
+};
+
+struct SizeClassConfig
+{
+	size_t mBlockSize = 0;
+	size_t mInitialBlocks = 0;
+	GrowthPolicy mGrowthPolicy = GrowthPolicy::None;
+	PoolBacking mBacking = PoolBacking::Auto;
+
+	// Upper bound on the number of blocks across all chunks of the pool. 0 means unbounded
+	size_t mMaxBlocks = 0;
+
+	ReusePolicy mReusePolicy = ReusePolicy::Lifo;
+
+	// Slab layout: the pool is made of slabs of this many bytes, each with its own header, and slabs left empty are released.
+	// 0 sizes chunks by the growth policy instead
+	size_t mSlabBytes = 0;
+
+	ExhaustionPolicy mExhaustionPolicy = ExhaustionPolicy::ReturnNull;
+
+	// Upper bound on the bytes of blocks allocated from the pool at once. Allocations past it fail without growing the pool. 0 means unbounded
+	size_t mQuotaBytes = 0;
+
+	FaultPolicy mFaultPolicy = FaultPolicy::Lazy;
+};
+
+// Configuration of a MemoryManager.
+// Text form, one entry per line (or separated by ';'), '#' starts a comment:
+//
+//		<block size> <initial blocks> [<key>=<value> ...]
+//		default <initial blocks> [<key>=<value> ...]
+//		budget <bytes>
+//
+// Keys, in any order, each optional:
+//
+//		growth=none|linear|double				backing=auto|heap|mmap|hugepages		max=<blocks>
+//		reuse=lifo|lowest|fullest|random		slab=<bytes>							exhausted=null|grow|throw|handler|upstream
+//		quota=<bytes>							fault=lazy|prefault|lock
+//
+// e.g. "64 16384 backing=mmap fault=lock". Size classes start from the "default" entry listed before them, except for max and quota.
+// The "default" entry also applies to pools created on demand for sizes above every listed size class
+struct MemoryManagerConfig
+{
+	std::vector<SizeClassConfig> mSizeClasses;
+	SizeClassConfig mDefaults;
+
+	// Upper bound on the bytes of blocks allocated across every pool at once. 0 means unbounded
+	size_t mBudgetBytes = 0;
+
+	// Record which pages hold the blocks of every chunk mapped from the OS (any backing but PoolBacking::Heap), so that any thread
+	// may find their size class with MemoryManager::FindMappedBlockSize() without a lock. Not part of the text form
+	bool mTrackMappedPages = false;
+
+	// Pools of 8, 16 and 32 bytes of numBlocksPerPool blocks each, which never grow
+	static MemoryManagerConfig Default(size_t numBlocksPerPool)
+	{
+		MemoryManagerConfig config;
+		config.mDefaults.mInitialBlocks = numBlocksPerPool;
+
+		for (size_t blockSize = 8; blockSize <= 32; blockSize *= 2)
+		{
+			SizeClassConfig sizeClass = config.mDefaults;
+			sizeClass.mBlockSize = blockSize;
+			config.mSizeClasses.push_back(sizeClass);
+		}
+
+		return config;
+	}
+
+	// General-purpose size classes, for standing in for malloc() or operator new: every 16 bytes up to 128, then four per power of two
+	// up to maxBlockSize. Pools are laid out in slabs of slabBytes, grow a slab at a time and give empty slabs back
+	static MemoryManagerConfig General(size_t maxBlockSize, size_t slabBytes);
+
+	// Apply settings from text. If it lists any size class, those replace the current ones.
+	// Returns false (leaving the config unchanged) on a malformed entry
+	bool Parse(const std::string& text);
+
+	// Parse() the contents of a file
+	bool LoadFromFile(const char* path);
+
+	// Parse() the file named by MEMORY_MANAGER_CONFIG_FILE, then the text in MEMORY_MANAGER_CONFIG.
+	// Unset variables are skipped. Returns false if a set variable could not be loaded
+	bool LoadFromEnvironment();
+};
+
+
+inline MemoryManagerConfig MemoryManagerConfig::General(size_t maxBlockSize, size_t slabBytes)
+{
+	MemoryManagerConfig config;
+
+	size_t blockSize = 16;
+	while (blockSize <= maxBlockSize)
+	{
+		SizeClassConfig sizeClass;
+		sizeClass.mBlockSize = blockSize;
+		sizeClass.mGrowthPolicy = GrowthPolicy::Linear;
+		sizeClass.mSlabBytes = slabBytes;
+
+		// Blocks that fit in one slab: each takes a bit of the bitfield too, and the rest of the header is under two cache lines
+		size_t blocksPerSlab = (slabBytes > 128) ? (slabBytes - 128) * 8 / (blockSize * 8 + 1) : 0;
+		sizeClass.mInitialBlocks = (blocksPerSlab > 0) ? blocksPerSlab : 1;
+		config.mSizeClasses.push_back(sizeClass);
+
+		size_t step = 16;
+		if (blockSize >= 128)
+		{
+			size_t powerOfTwo = 128;
+			while (powerOfTwo * 2 <= blockSize)
+			{
+				powerOfTwo *= 2;
+			}
+			step = powerOfTwo / 4;
+		}
+
+		blockSize += step;
+	}
+
+	return config;
+}
+
+
+inline bool ParseGrowthPolicy(const std::string& word, GrowthPolicy& growthPolicy)
+{
+	if (word == "none")			{ growthPolicy = GrowthPolicy::None; }
+	else if (word == "linear")	{ growthPolicy = GrowthPolicy::Linear; }
+	else if (word == "double")	{ growthPolicy = GrowthPolicy::Double; }
+	else { return false; }
+
+	return true;
+}
+
+
+inline bool ParsePoolBacking(const std::string& word, PoolBacking& backing)
+{
+	if (word == "auto")				{ backing = PoolBacking::Auto; }
+	else if (word == "heap")		{ backing = PoolBacking::Heap; }
+	else if (word == "mmap")		{ backing = PoolBacking::Mmap; }
+	else if (word == "hugepages")	{ backing = PoolBacking::HugePages; }
+	else { return false; }
+
+	return true;
+}
+
+
+inline bool ParseReusePolicy(const std::string& word, ReusePolicy& reusePolicy)
+{
+	if (word == "lifo")			{ reusePolicy = ReusePolicy::Lifo; }
+	else if (word == "lowest")	{ reusePolicy = ReusePolicy::LowestAddress; }
+	else if (word == "fullest")	{ reusePolicy = ReusePolicy::FullestPage; }
+	else if (word == "random")	{ reusePolicy = ReusePolicy::Random; }
+	else { return false; }
+
+	return true;
+}
+
+
+inline bool ParseExhaustionPolicy(const std::string& word, ExhaustionPolicy& exhaustionPolicy)
+{
+	if (word == "null")				{ exhaustionPolicy = ExhaustionPolicy::ReturnNull; }
+	else if (word == "grow")		{ exhaustionPolicy = ExhaustionPolicy::Grow; }
+	else if (word == "throw")		{ exhaustionPolicy = ExhaustionPolicy::Throw; }
+	else if (word == "handler")		{ exhaustionPolicy = ExhaustionPolicy::Handler; }
+	else if (word == "upstream")	{ exhaustionPolicy = ExhaustionPolicy::Upstream; }
+	else { return false; }
+
+	return true;
+}
+
+
+inline bool ParseFaultPolicy(const std::string& word, FaultPolicy& faultPolicy)
+{
+	if (word == "lazy")				{ faultPolicy = FaultPolicy::Lazy; }
+	else if (word == "prefault")	{ faultPolicy = FaultPolicy::Prefault; }
+	else if (word == "lock")		{ faultPolicy = FaultPolicy::Lock; }
+	else { return false; }
+
+	return true;
+}
+
+
+// Decimal count of blocks or bytes, with nothing after it
+inline bool ParseCount(const std::string& word, size_t& count)
+{
+	if (word.empty() || word[0] < '0' || word[0] > '9')
+	{
+		return false;
+	}
+
+	char* end = nullptr;
+	count = strtoull(word.c_str(), &end, 10);
+	return *end == '\0';
+}
+
+
+// One <key>=<value> field of a size class entry
+inline bool ParseSizeClassField(const std::string& key, const std::string& value, SizeClassConfig& sizeClass)
+{
+	if (key == "growth")			{ return ParseGrowthPolicy(value, sizeClass.mGrowthPolicy); }
+	else if (key == "backing")		{ return ParsePoolBacking(value, sizeClass.mBacking); }
+	else if (key == "max")			{ return ParseCount(value, sizeClass.mMaxBlocks); }
+	else if (key == "reuse")		{ return ParseReusePolicy(value, sizeClass.mReusePolicy); }
+	else if (key == "slab")			{ return ParseCount(value, sizeClass.mSlabBytes); }
+	else if (key == "exhausted")	{ return ParseExhaustionPolicy(value, sizeClass.mExhaustionPolicy); }
+	else if (key == "quota")		{ return ParseCount(value, sizeClass.mQuotaBytes); }
+	else if (key == "fault")		{ return ParseFaultPolicy(value, sizeClass.mFaultPolicy); }
+
+	return false;
+}
+
+
+inline bool MemoryManagerConfig::Parse(const std::string& text)
+{
+	std::vector<SizeClassConfig> sizeClasses;
+	SizeClassConfig defaults = mDefaults;
+	size_t budgetBytes = mBudgetBytes;
+
+	std::string entries = text;
+	for (char& character : entries)
+	{
+		if (character == ';')
+		{
+			character = '\n';
+		}
+	}
+
+	std::istringstream entryStream(entries);
+	std::string entry;
+	while (std::getline(entryStream, entry))
+	{
+		size_t commentStart = entry.find('#');
+		if (commentStart != std::string::npos)
+		{
+			entry.erase(commentStart);
+		}
+
+		std::istringstream fieldStream(entry);
+		std::string first;
+		if (!(fieldStream >> first))
+		{
+			continue; // Blank line
+		}
+
+		if (first == "budget")
+		{
+			if (!(fieldStream >> budgetBytes) || !(fieldStream >> std::ws).eof())
+			{
+#ifdef _DEBUG
+				printf("[FAILURE] Malformed config entry '%s'\n", entry.c_str());
+#endif // _DEBUG
+				return false;
+			}
+
+			continue;
+		}
+
+		bool isDefault = (first == "default");
+		SizeClassConfig sizeClass = defaults;
+		sizeClass.mMaxBlocks = 0;
+		sizeClass.mQuotaBytes = 0;
+
+		if (!isDefault)
+		{
+			char* end = nullptr;
+			sizeClass.mBlockSize = strtoull(first.c_str(), &end, 10);
+			if (*end != '\0' || sizeClass.mBlockSize < sizeof(void*))
+			{
+#ifdef _DEBUG
+				printf("[FAILURE] Invalid block size in config entry '%s'\n", entry.c_str());
+#endif // _DEBUG
+				return false;
+			}
+		}
+
+		bool valid = static_cast<bool>(fieldStream >> sizeClass.mInitialBlocks) && sizeClass.mInitialBlocks > 0;
+
+		std::string field;
+		while (valid && (fieldStream >> field))
+		{
+			size_t separator = field.find('=');
+			valid = separator != std::string::npos && ParseSizeClassField(field.substr(0, separator), field.substr(separator + 1), sizeClass);
+		}
+
+		if (!valid)
+		{
+#ifdef _DEBUG
+			printf("[FAILURE] Malformed config entry '%s'\n", entry.c_str());
+#endif // _DEBUG
+			return false;
+		}
+
+		if (isDefault)
+		{
+			defaults = sizeClass;
+		}
+		else
+		{
+			sizeClasses.push_back(sizeClass);
+		}
+	}
+
+	mDefaults = defaults;
+	mBudgetBytes = budgetBytes;
+	if (!sizeClasses.empty())
+	{
+		mSizeClasses = sizeClasses;
+	}
+
+	return true;
+}
+
+
+inline bool MemoryManagerConfig::LoadFromFile(const char* path)
+{
+	std::ifstream file(path);
+	if (!file)
+	{
+#ifdef _DEBUG
+		printf("[FAILURE] Could not open config file %s\n", path);
+#endif // _DEBUG
+		return false;
+	}
+
+	std::stringstream contents;
+	contents << file.rdbuf();
+	return Parse(contents.str());
+}
+
+
+// Value of an environment variable. Returns false if it is not set
+inline bool GetEnvironmentVariableValue(const char* name, std::string& value)
+{
+#if defined(_MSC_VER)
+	char* buffer = nullptr;
+	size_t length = 0;
+	if (_dupenv_s(&buffer, &length, name) != 0 || !buffer)
+	{
+		return false;
+	}
+
+	value = buffer;
+	free(buffer);
+	return true;
+#else
+	const char* buffer = getenv(name);
+	if (!buffer)
+	{
+		return false;
+	}
+
+	value = buffer;
+	return true;
+#endif
+}
+
+
+inline bool MemoryManagerConfig::LoadFromEnvironment()
+{
+	std::string value;
+
+	if (GetEnvironmentVariableValue("MEMORY_MANAGER_CONFIG_FILE", value) && !LoadFromFile(value.c_str()))
+	{
+		return false;
+	}
+
+	if (GetEnvironmentVariableValue("MEMORY_MANAGER_CONFIG", value) && !Parse(value))
+	{
+		return false;
+	}
+
+	return true;
+}
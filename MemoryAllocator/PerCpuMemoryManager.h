@@ -0,0 +1,465 @@
+/* =========================================================================================
+*
+*	Class:		Per-CPU Memory Manager
+*	Purpose:	Thread-safe front end for the Memory Manager with a small cache of blocks per CPU
+*	Author:		Sreyash (Srey) Raychaudhuri
+*	Date:		12/22/2024
+*
+* ==========================================================================================
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "MemoryManager.h"
+#include "PlatformMemory.h"
+
+// Per-CPU magazines need restartable sequences: Linux rseq, registered for every thread by glibc 2.35 and later.
+// ThreadSanitizer cannot see the ordering the kernel provides between threads sharing a CPU, so sanitized builds take the locked path
+#if defined(__linux__) && defined(__x86_64__) && defined(__GNUC__) && defined(__has_include) && !defined(__SANITIZE_THREAD__)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <unistd.h>
+#define MM_HAVE_RSEQ 1
+#endif
+#endif
+
+#define DEFAULT_MAGAZINE_CAPACITY	32
+#define MAX_MAGAZINE_CAPACITY		256
+
+#if defined(MM_HAVE_RSEQ)
+
+// rseq area glibc registered for the calling thread, nullptr if registration failed (old kernel, or disabled through GLIBC_TUNABLES)
+inline struct rseq* GetRseqArea()
+{
+	if (__rseq_size == 0)
+	{
+		return nullptr;
+	}
+
+	return reinterpret_cast<struct rseq*>(static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+}
+
+// Pop a block from the magazine of the current CPU, magazines being [count][blocks...] at base + cpu * cpuStride.
+// The kernel restarts the sequence (through the abort handler) if the thread is preempted or migrated before the count is stored,
+// so the CPU-local magazine needs neither a lock nor an atomic. nullptr if the magazine is empty or the sequence was aborted.
+// The descriptor and abort handler sections join the section group of the calling function ("?"), so the linker discards them along with
+// duplicate copies of an inline caller
+inline void* RseqPop(struct rseq* area, char* base, size_t cpuStride, uint32_t numCpus)
+{
+	void* block;
+
+	__asm__ __volatile__(
+		".pushsection __rseq_cs, \"aw?\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, 2f - 1f, 4f\n\t"
+		".popsection\n\t"
+		".pushsection __rseq_failure, \"ax?\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long %c[signature]\n\t"
+		"4:\n\t"
+		"xorq %[block], %[block]\n\t"
+		"jmp 5f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %c[csOffset](%[area])\n\t"
+		"1:\n\t"
+		"movl %c[cpuOffset](%[area]), %%eax\n\t"
+		"cmpl %[numCpus], %%eax\n\t"
+		"jae 6f\n\t"
+		"imulq %[cpuStride], %%rax\n\t"
+		"addq %[base], %%rax\n\t"
+		"movq (%%rax), %%rdx\n\t"
+		"testq %%rdx, %%rdx\n\t"
+		"jz 6f\n\t"
+		"movq (%%rax, %%rdx, 8), %[block]\n\t"
+		"decq %%rdx\n\t"
+		"movq %%rdx, (%%rax)\n\t"
+		"2:\n\t"
+		"jmp 5f\n\t"
+		"6:\n\t"
+		"xorq %[block], %[block]\n\t"
+		"5:\n\t"
+		: [block] "=&r"(block)
+		: [area] "r"(area), [base] "r"(base), [cpuStride] "r"(cpuStride), [numCpus] "r"(numCpus),
+		  [signature] "i"(RSEQ_SIG), [csOffset] "i"(offsetof(struct rseq, rseq_cs)), [cpuOffset] "i"(offsetof(struct rseq, cpu_id))
+		: "rax", "rdx", "memory", "cc");
+
+	return block;
+}
+
+// Push a block onto the magazine of the current CPU. Returns false if the magazine is full or the sequence was aborted
+inline bool RseqPush(struct rseq* area, char* base, size_t cpuStride, uint32_t numCpus, size_t capacity, void* block)
+{
+	int pushed;
+
+	__asm__ __volatile__(
+		".pushsection __rseq_cs, \"aw?\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, 2f - 1f, 4f\n\t"
+		".popsection\n\t"
+		".pushsection __rseq_failure, \"ax?\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long %c[signature]\n\t"
+		"4:\n\t"
+		"xorl %k[pushed], %k[pushed]\n\t"
+		"jmp 5f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %c[csOffset](%[area])\n\t"
+		"1:\n\t"
+		"movl %c[cpuOffset](%[area]), %%eax\n\t"
+		"cmpl %[numCpus], %%eax\n\t"
+		"jae 6f\n\t"
+		"imulq %[cpuStride], %%rax\n\t"
+		"addq %[base], %%rax\n\t"
+		"movq (%%rax), %%rdx\n\t"
+		"cmpq %[capacity], %%rdx\n\t"
+		"jae 6f\n\t"
+		"movq %[block], 8(%%rax, %%rdx, 8)\n\t"
+		"incq %%rdx\n\t"
+		"movq %%rdx, (%%rax)\n\t"
+		"2:\n\t"
+		"movl $1, %k[pushed]\n\t"
+		"jmp 5f\n\t"
+		"6:\n\t"
+		"xorl %k[pushed], %k[pushed]\n\t"
+		"5:\n\t"
+		: [pushed] "=&r"(pushed)
+		: [area] "r"(area), [base] "r"(base), [cpuStride] "r"(cpuStride), [numCpus] "r"(numCpus), [capacity] "r"(capacity), [block] "r"(block),
+		  [signature] "i"(RSEQ_SIG), [csOffset] "i"(offsetof(struct rseq, rseq_cs)), [cpuOffset] "i"(offsetof(struct rseq, cpu_id))
+		: "rax", "rdx", "memory", "cc");
+
+	return pushed != 0;
+}
+
+#endif // MM_HAVE_RSEQ
+
+// Memory Manager that any thread may allocate from. Each CPU keeps a magazine of a few blocks per size class, so most calls touch only
+// CPU-local memory without a lock or atomic, and memory does not grow with the number of threads the way per-thread caches do.
+// Magazines are refilled from and drained to the pools half a magazine at a time, under a lock.
+// Where rseq is unavailable (other platforms, old kernels, threads glibc did not register) every call takes the lock instead.
+// Blocks freed into a magazine are only checked (foreign pointer, double free) once they reach the pools
+class PerCpuMemoryManager
+{
+public:
+	// Pools for every size class listed in config, with magazines of magazineCapacity blocks (at most MAX_MAGAZINE_CAPACITY)
+	explicit PerCpuMemoryManager(const MemoryManagerConfig& config, size_t magazineCapacity = DEFAULT_MAGAZINE_CAPACITY, bool usePerCpuCaches = true);
+	~PerCpuMemoryManager();
+
+	PerCpuMemoryManager(const PerCpuMemoryManager&) = delete;
+	PerCpuMemoryManager& operator=(const PerCpuMemoryManager&) = delete;
+
+	template<typename T>
+	T* Allocate() { return reinterpret_cast<T*>(Allocate(sizeof(T))); }
+
+	template<typename T>
+	void Free(T** ppBlock)
+	{
+		if (Free(static_cast<void*>(*ppBlock), sizeof(T)))
+		{
+			*ppBlock = nullptr;
+		}
+	}
+
+	void* Allocate(size_t size);
+	bool Free(void* block, size_t size);
+
+	// Resize a block as MemoryManager::Reallocate() does: kept when oldSize and newSize share a size class, moved otherwise
+	void* Reallocate(void* block, size_t oldSize, size_t newSize);
+
+	// Hand every block cached in a magazine back to the pools. No other thread may use the manager meanwhile
+	void Flush();
+
+	// Number of allocated blocks in the pool of the given size class. Blocks cached in magazines count as allocated until Flush()
+	size_t CountLive(size_t sizeClass);
+
+	// Block size of the pool holding block, 0 if it lies in no pool. Blocks cached in magazines still count as in their pool
+	size_t GetBlockSize(const void* block);
+
+	// GetBlockSize() without the lock, for pools whose config sets mTrackMappedPages: see MemoryManager::FindMappedBlockSize()
+	size_t FindMappedBlockSize(const void* block) const { return mBackend.FindMappedBlockSize(block); }
+
+	// Take and release the lock serializing access to the pools, e.g. around fork() so the child does not inherit it held
+	void Lock() { mMutex.lock(); }
+	void Unlock() { mMutex.unlock(); }
+
+	// Whether calls go through per-CPU magazines rather than straight to the locked pools
+	bool UsesPerCpuCaches() const { return mMagazines != nullptr; }
+
+private:
+	// Size class index (into mBlockSizes) serving size bytes, SIZE_MAX if no configured class does
+	size_t GetClassIndex(size_t size) const;
+
+	// Magazine of a CPU for a size class: a block count followed by the cached blocks, padded to whole cache lines
+	char* GetMagazine(size_t cpu, size_t classIndex) const { return mMagazines + cpu * mCpuStride + classIndex * mMagazineStride; }
+
+	void* PopCached(size_t classIndex);
+	bool PushCached(size_t classIndex, void* block);
+
+	// Allocate / Free on the pools. The lock makes the calling thread the owner for the duration of the call
+	void* AllocateLocked(size_t size);
+	bool FreeLocked(void* const* blocks, size_t count, size_t size);
+
+	MemoryManager mBackend;
+	std::mutex mMutex;
+
+	// Block size of each configured size class, ascending
+	std::vector<size_t> mBlockSizes;
+
+	size_t mMagazineCapacity = 0;
+	size_t mMagazineStride = 0;
+	size_t mCpuStride = 0;
+	uint32_t mNumCpus = 0;
+
+	// Magazines of every CPU and size class, nullptr while per-CPU caching is off
+	char* mMagazines = nullptr;
+	size_t mMagazineBytes = 0;
+};
+
+
+inline PerCpuMemoryManager::PerCpuMemoryManager(const MemoryManagerConfig& config, size_t magazineCapacity, bool usePerCpuCaches)
+	: mBackend(config), mMagazineCapacity(std::min<size_t>(std::max<size_t>(magazineCapacity, 2), MAX_MAGAZINE_CAPACITY))
+{
+	for (const SizeClassConfig& sizeClass : config.mSizeClasses)
+	{
+		mBlockSizes.push_back(sizeClass.mBlockSize);
+	}
+
+	std::sort(mBlockSizes.begin(), mBlockSizes.end());
+
+#if defined(MM_HAVE_RSEQ)
+	long numCpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (!usePerCpuCaches || !GetRseqArea() || numCpus <= 0 || mBlockSizes.empty())
+	{
+		return;
+	}
+
+	mNumCpus = static_cast<uint32_t>(numCpus);
+	mMagazineStride = ((1 + mMagazineCapacity) * sizeof(void*) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+	mCpuStride = mMagazineStride * mBlockSizes.size();
+	mMagazineBytes = mCpuStride * mNumCpus;
+
+	// Zero-filled, so every magazine starts empty
+	mMagazines = reinterpret_cast<char*>(MapPages(mMagazineBytes));
+#else
+	(void)usePerCpuCaches;
+#endif // MM_HAVE_RSEQ
+}
+
+
+inline PerCpuMemoryManager::~PerCpuMemoryManager()
+{
+	Flush();
+
+	if (mMagazines)
+	{
+		UnmapPages(mMagazines, mMagazineBytes);
+	}
+
+	// Pools are released (and leaks reported) by the destroying thread
+	mBackend.SetOwnerThread();
+}
+
+
+inline size_t PerCpuMemoryManager::GetClassIndex(size_t size) const
+{
+	auto iter = std::lower_bound(mBlockSizes.begin(), mBlockSizes.end(), size);
+	return iter == mBlockSizes.end() ? SIZE_MAX : static_cast<size_t>(iter - mBlockSizes.begin());
+}
+
+
+inline void* PerCpuMemoryManager::PopCached(size_t classIndex)
+{
+#if defined(MM_HAVE_RSEQ)
+	struct rseq* area = GetRseqArea();
+	return RseqPop(area, mMagazines + classIndex * mMagazineStride, mCpuStride, mNumCpus);
+#else
+	(void)classIndex;
+	return nullptr;
+#endif // MM_HAVE_RSEQ
+}
+
+
+inline bool PerCpuMemoryManager::PushCached(size_t classIndex, void* block)
+{
+#if defined(MM_HAVE_RSEQ)
+	struct rseq* area = GetRseqArea();
+	return RseqPush(area, mMagazines + classIndex * mMagazineStride, mCpuStride, mNumCpus, mMagazineCapacity, block);
+#else
+	(void)classIndex;
+	(void)block;
+	return false;
+#endif // MM_HAVE_RSEQ
+}
+
+
+inline void* PerCpuMemoryManager::AllocateLocked(size_t size)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mBackend.SetOwnerThread();
+	return mBackend.Allocate(size);
+}
+
+
+inline bool PerCpuMemoryManager::FreeLocked(void* const* blocks, size_t count, size_t size)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mBackend.SetOwnerThread();
+
+	bool freed = true;
+	for (size_t index = 0; index < count; index++)
+	{
+		freed = mBackend.Free(blocks[index], size) && freed;
+	}
+
+	return freed;
+}
+
+
+inline void* PerCpuMemoryManager::Allocate(size_t size)
+{
+	size_t classIndex = GetClassIndex(size);
+	if (!mMagazines || classIndex == SIZE_MAX)
+	{
+		return AllocateLocked(size);
+	}
+
+	void* block = PopCached(classIndex);
+	if (block)
+	{
+		return block;
+	}
+
+	// Magazine is empty: take half a magazine from the pool under one lock, return the first block and cache the rest
+	void* batch[MAX_MAGAZINE_CAPACITY / 2];
+	size_t batchSize = 0;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mBackend.SetOwnerThread();
+		while (batchSize < mMagazineCapacity / 2 && (batch[batchSize] = mBackend.Allocate(mBlockSizes[classIndex])) != nullptr)
+		{
+			batchSize++;
+		}
+	}
+
+	// Blocks that do not fit (the thread moved to another CPU whose magazine is full) go straight back
+	size_t cachedCount = 1;
+	while (cachedCount < batchSize && PushCached(classIndex, batch[cachedCount]))
+	{
+		cachedCount++;
+	}
+
+	if (cachedCount < batchSize)
+	{
+		FreeLocked(batch + cachedCount, batchSize - cachedCount, mBlockSizes[classIndex]);
+	}
+
+	return batchSize ? batch[0] : nullptr;
+}
+
+
+inline bool PerCpuMemoryManager::Free(void* block, size_t size)
+{
+	if (!block)
+	{
+		return false;
+	}
+
+	size_t classIndex = GetClassIndex(size);
+	if (!mMagazines || classIndex == SIZE_MAX)
+	{
+		return FreeLocked(&block, 1, size);
+	}
+
+	if (PushCached(classIndex, block))
+	{
+		return true;
+	}
+
+	// Magazine is full: hand half of it back to the pool along with the block, under one lock
+	void* batch[MAX_MAGAZINE_CAPACITY / 2 + 1];
+	size_t batchSize = 0;
+	batch[batchSize++] = block;
+	while (batchSize <= mMagazineCapacity / 2 && (batch[batchSize] = PopCached(classIndex)) != nullptr)
+	{
+		batchSize++;
+	}
+
+	return FreeLocked(batch, batchSize, mBlockSizes[classIndex]);
+}
+
+
+inline void* PerCpuMemoryManager::Reallocate(void* block, size_t oldSize, size_t newSize)
+{
+	if (!block)
+	{
+		return Allocate(newSize);
+	}
+
+	size_t classIndex = GetClassIndex(oldSize);
+	if (classIndex != SIZE_MAX && classIndex == GetClassIndex(newSize))
+	{
+		return block;
+	}
+
+	void* newBlock = Allocate(newSize);
+	if (!newBlock)
+	{
+		return nullptr;
+	}
+
+	memcpy(newBlock, block, std::min(oldSize, newSize));
+	Free(block, oldSize);
+	return newBlock;
+}
+
+
+inline void PerCpuMemoryManager::Flush()
+{
+	if (!mMagazines)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	mBackend.SetOwnerThread();
+
+	for (size_t cpu = 0; cpu < mNumCpus; cpu++)
+	{
+		for (size_t classIndex = 0; classIndex < mBlockSizes.size(); classIndex++)
+		{
+			uintptr_t* magazine = reinterpret_cast<uintptr_t*>(GetMagazine(cpu, classIndex));
+			for (uintptr_t index = 1; index <= magazine[0]; index++)
+			{
+				mBackend.Free(reinterpret_cast<void*>(magazine[index]), mBlockSizes[classIndex]);
+			}
+
+			magazine[0] = 0;
+		}
+	}
+}
+
+
+inline size_t PerCpuMemoryManager::CountLive(size_t sizeClass)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mBackend.SetOwnerThread();
+	return mBackend.CountLive(sizeClass);
+}
+
+
+inline size_t PerCpuMemoryManager::GetBlockSize(const void* block)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mBackend.GetBlockSize(block);
+}
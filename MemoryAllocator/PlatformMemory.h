@@ -0,0 +1,362 @@
+/* =========================================================================================
+*
+*	Purpose:	OS-level memory reservation for Memory Manager pools
+*	Author:		Sreyash (Srey) Raychaudhuri
+*	Date:		12/22/2024
+*
+* ==========================================================================================
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#include "MemoryManagerConfig.h"
+
+#if defined(_WIN32)
+#include <malloc.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// With PoolBacking::Auto, chunks of at least this many bytes are mapped straight from the OS rather than the heap.
+// Their pages come zero-filled and are only backed by physical memory on first touch
+#define OS_ALLOCATION_THRESHOLD (64 * 1024)
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Granularity of ReusePolicy::FullestPage
+#define OS_PAGE_SIZE 4096
+
+// Data written by different threads is kept on separate lines of this size, so writes by one thread do not evict the other's copy
+#define CACHE_LINE_SIZE 64
+
+
+// Anonymous read-write mapping of bytes. Returns nullptr on failure
+inline void* MapPages(size_t bytes)
+{
+#if defined(_WIN32)
+	return VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return memory == MAP_FAILED ? nullptr : memory;
+#endif
+}
+
+
+inline void UnmapPages(void* memory, size_t bytes)
+{
+#if defined(_WIN32)
+	(void)bytes;
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, bytes);
+#endif
+}
+
+
+// Mapping of bytes on explicitly reserved huge pages. On success bytes is rounded up to the huge page size. Returns nullptr if none are available
+inline void* MapHugePages(size_t& bytes)
+{
+#if defined(_WIN32)
+	// Needs SeLockMemoryPrivilege; fails without it
+	size_t hugePageSize = GetLargePageMinimum();
+	if (hugePageSize == 0 || bytes > SIZE_MAX - hugePageSize)
+	{
+		return nullptr;
+	}
+
+	size_t roundedBytes = (bytes + hugePageSize - 1) / hugePageSize * hugePageSize;
+	void* memory = VirtualAlloc(nullptr, roundedBytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+#elif defined(MAP_HUGETLB)
+	if (bytes > SIZE_MAX - HUGE_PAGE_SIZE)
+	{
+		return nullptr;
+	}
+
+	size_t roundedBytes = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	void* memory = mmap(nullptr, roundedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (memory == MAP_FAILED)
+	{
+		memory = nullptr;
+	}
+#else
+	size_t roundedBytes = bytes;
+	void* memory = nullptr;
+#endif
+
+	if (memory)
+	{
+		bytes = roundedBytes;
+	}
+
+	return memory;
+}
+
+
+// Lock bytes of memory in physical memory, faulting in any page not backed yet. Returns false if the lock limit of the process is hit
+inline bool LockPages(void* memory, size_t bytes)
+{
+#if defined(_WIN32)
+	return VirtualLock(memory, bytes) != 0;
+#else
+	return mlock(memory, bytes) == 0;
+#endif
+}
+
+
+inline void UnlockPages(void* memory, size_t bytes)
+{
+#if defined(_WIN32)
+	VirtualUnlock(memory, bytes);
+#else
+	munlock(memory, bytes);
+#endif
+}
+
+
+// Back every page of fresh memory now rather than on first touch, and with lock keep them resident. Zeroes a byte of each page.
+// Returns false if the pages could not be locked
+inline bool PrefaultPages(void* memory, size_t bytes, bool lock)
+{
+	if (lock && !LockPages(memory, bytes))
+	{
+		return false;
+	}
+
+	// Writes rather than reads: a read would only map the shared zero page, and the first write would still fault
+	volatile char* bytePointer = static_cast<volatile char*>(memory);
+	for (size_t offset = 0; offset < bytes; offset += OS_PAGE_SIZE)
+	{
+		bytePointer[offset] = 0;
+	}
+
+	if (bytes)
+	{
+		bytePointer[bytes - 1] = 0;
+	}
+
+	return true;
+}
+
+
+// Reserve memory for a chunk of a pool. Returns nullptr on failure.
+// backing is updated to the backing actually used (PoolBacking::Auto is resolved, huge pages may fall back to regular pages) and
+// bytes to the number of bytes reserved; both must be handed back to ReleasePoolMemory
+inline void* AllocatePoolMemory(size_t& bytes, PoolBacking& backing)
+{
+	if (backing == PoolBacking::Auto)
+	{
+		backing = (bytes < OS_ALLOCATION_THRESHOLD) ? PoolBacking::Heap : PoolBacking::Mmap;
+	}
+
+	// Heap chunks are aligned like mapped ones, so their header and first block start on a cache line of their own
+	if (backing == PoolBacking::Heap)
+	{
+#if defined(_WIN32)
+		return _aligned_malloc(bytes, CACHE_LINE_SIZE);
+#else
+		void* memory = nullptr;
+		return posix_memalign(&memory, CACHE_LINE_SIZE, bytes) == 0 ? memory : nullptr;
+#endif
+	}
+
+	if (backing == PoolBacking::HugePages)
+	{
+		void* memory = MapHugePages(bytes);
+		if (memory)
+		{
+			return memory;
+		}
+
+		backing = PoolBacking::Mmap;
+		memory = MapPages(bytes);
+
+#if defined(MADV_HUGEPAGE)
+		// No reserved huge pages: let the kernel back the mapping with transparent huge pages where it can
+		if (memory)
+		{
+			madvise(memory, bytes, MADV_HUGEPAGE);
+		}
+#endif
+
+		return memory;
+	}
+
+	return MapPages(bytes);
+}
+
+
+// Release memory obtained from AllocatePoolMemory
+inline void ReleasePoolMemory(void* memory, size_t bytes, PoolBacking backing)
+{
+	if (backing == PoolBacking::Heap)
+	{
+#if defined(_WIN32)
+		_aligned_free(memory);
+#else
+		free(memory);
+#endif
+		return;
+	}
+
+	UnmapPages(memory, bytes);
+}
+
+
+// Lock-free map from the pages of the address space to a value each, 0 for pages never set. Any thread may Get() while others Set(),
+// and threads may Set() different pages at once. Covers addresses below 2^48. Tables are mapped on first use and kept until destruction,
+// so a lookup never touches released memory
+class PageMap
+{
+public:
+	PageMap() = default;
+	~PageMap();
+
+	PageMap(const PageMap&) = delete;
+	PageMap& operator=(const PageMap&) = delete;
+
+	// Give every page overlapping [memory, memory + bytes) the value; 0 clears them. Returns false if a table could not be mapped
+	bool Set(const void* memory, size_t bytes, uintptr_t value);
+
+	// Value of the page holding address
+	uintptr_t Get(const void* address) const;
+
+private:
+	// 4 KiB pages: each leaf table covers 1 GiB, the root table 2^48 bytes
+	static const unsigned PAGE_BITS = 12;
+	static const unsigned LEAF_BITS = 18;
+	static const unsigned ROOT_BITS = 48 - PAGE_BITS - LEAF_BITS;
+
+	typedef std::atomic<uintptr_t> Leaf;
+
+	// Leaf table covering address, nullptr if there is none
+	Leaf* FindLeaf(uintptr_t address) const;
+
+	// Leaf table covering address, mapped first if there is none. nullptr if it could not be mapped
+	Leaf* GetLeaf(uintptr_t address);
+
+	std::atomic<std::atomic<Leaf*>*> mRoot{ nullptr };
+};
+
+
+inline PageMap::~PageMap()
+{
+	std::atomic<Leaf*>* root = mRoot.load(std::memory_order_acquire);
+	if (!root)
+	{
+		return;
+	}
+
+	for (size_t index = 0; index < (size_t(1) << ROOT_BITS); index++)
+	{
+		Leaf* leaf = root[index].load(std::memory_order_relaxed);
+		if (leaf)
+		{
+			UnmapPages(leaf, sizeof(Leaf) << LEAF_BITS);
+		}
+	}
+
+	UnmapPages(root, sizeof(std::atomic<Leaf*>) << ROOT_BITS);
+}
+
+
+inline PageMap::Leaf* PageMap::FindLeaf(uintptr_t address) const
+{
+	std::atomic<Leaf*>* root = mRoot.load(std::memory_order_acquire);
+	if (!root || static_cast<uint64_t>(address) >> (PAGE_BITS + LEAF_BITS + ROOT_BITS))
+	{
+		return nullptr;
+	}
+
+	return root[static_cast<uint64_t>(address) >> (PAGE_BITS + LEAF_BITS)].load(std::memory_order_acquire);
+}
+
+
+inline PageMap::Leaf* PageMap::GetLeaf(uintptr_t address)
+{
+	if (static_cast<uint64_t>(address) >> (PAGE_BITS + LEAF_BITS + ROOT_BITS))
+	{
+		return nullptr;
+	}
+
+	// Tables are zero-filled mappings, so every entry starts out null. Of threads racing to map the same table, the first one wins
+	std::atomic<Leaf*>* root = mRoot.load(std::memory_order_acquire);
+	if (!root)
+	{
+		std::atomic<Leaf*>* newRoot = reinterpret_cast<std::atomic<Leaf*>*>(MapPages(sizeof(std::atomic<Leaf*>) << ROOT_BITS));
+		if (!newRoot)
+		{
+			return nullptr;
+		}
+
+		if (mRoot.compare_exchange_strong(root, newRoot, std::memory_order_acq_rel))
+		{
+			root = newRoot;
+		}
+		else
+		{
+			UnmapPages(newRoot, sizeof(std::atomic<Leaf*>) << ROOT_BITS);
+		}
+	}
+
+	std::atomic<Leaf*>& rootEntry = root[static_cast<uint64_t>(address) >> (PAGE_BITS + LEAF_BITS)];
+	Leaf* leaf = rootEntry.load(std::memory_order_acquire);
+	if (!leaf)
+	{
+		Leaf* newLeaf = reinterpret_cast<Leaf*>(MapPages(sizeof(Leaf) << LEAF_BITS));
+		if (!newLeaf)
+		{
+			return nullptr;
+		}
+
+		if (rootEntry.compare_exchange_strong(leaf, newLeaf, std::memory_order_acq_rel))
+		{
+			leaf = newLeaf;
+		}
+		else
+		{
+			UnmapPages(newLeaf, sizeof(Leaf) << LEAF_BITS);
+		}
+	}
+
+	return leaf;
+}
+
+
+inline bool PageMap::Set(const void* memory, size_t bytes, uintptr_t value)
+{
+	uintptr_t begin = reinterpret_cast<uintptr_t>(memory) >> PAGE_BITS;
+	uintptr_t end = (reinterpret_cast<uintptr_t>(memory) + bytes + (uintptr_t(1) << PAGE_BITS) - 1) >> PAGE_BITS;
+	for (uintptr_t page = begin; page < end; page++)
+	{
+		Leaf* leaf = value ? GetLeaf(page << PAGE_BITS) : FindLeaf(page << PAGE_BITS);
+		if (leaf)
+		{
+			leaf[page & ((uintptr_t(1) << LEAF_BITS) - 1)].store(value, std::memory_order_release);
+		}
+		else if (value)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+inline uintptr_t PageMap::Get(const void* address) const
+{
+	Leaf* leaf = FindLeaf(reinterpret_cast<uintptr_t>(address));
+	return leaf ? leaf[(reinterpret_cast<uintptr_t>(address) >> PAGE_BITS) & ((uintptr_t(1) << LEAF_BITS) - 1)].load(std::memory_order_acquire) : 0;
+}
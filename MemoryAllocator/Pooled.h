@@ -0,0 +1,264 @@
+/* =========================================================================================
+*
+*	Class:		Pooled
+*	Purpose:	CRTP base routing new / delete of a type to a pool of its own
+*	Author:		Sreyash (Srey) Raychaudhuri
+*	Date:		12/22/2024
+*
+* ==========================================================================================
+*/
+
+#pragma once
+
+#include <mutex>
+#include <new>
+
+#include "MemoryManager.h"
+
+#define DEFAULT_POOLED_BLOCKS_PER_CHUNK	1024
+
+// Blocks each thread keeps for itself per pooled type
+#define POOLED_CACHE_CAPACITY			32
+
+// Derive T from Pooled<T> and "new T(...)" / "delete t" go through a pool of sizeof(T) blocks shared by every thread, which grows
+// NumBlocksPerChunk blocks at a time. Each thread caches up to POOLED_CACHE_CAPACITY free blocks, so most calls take no lock.
+// Classes derived from T with a different size, and arrays, still use the global operator new.
+// The pool is never destroyed, as objects may still be deleted by static destructors
+template<typename T, size_t NumBlocksPerChunk = DEFAULT_POOLED_BLOCKS_PER_CHUNK>
+class Pooled
+{
+public:
+	static void* operator new(size_t size);
+	static void* operator new(size_t size, const std::nothrow_t&) noexcept;
+	static void operator delete(void* block, size_t size) noexcept;
+	static void operator delete(void* block, const std::nothrow_t&) noexcept;
+
+	// Placement forms, which the ones above would otherwise hide
+	static void* operator new(size_t, void* place) noexcept { return place; }
+	static void operator delete(void*, void*) noexcept {}
+
+	// Number of blocks of T taken from the pool. Blocks cached by threads count as taken
+	static size_t CountLive();
+
+private:
+	// Block size of the pool. Blocks hold a free-list link while free
+	static constexpr size_t BLOCKSIZE = (sizeof(T) < sizeof(void*)) ? sizeof(void*) : sizeof(T);
+
+	struct SharedPool
+	{
+		std::mutex mMutex;
+		MemoryManager mMemoryManager;
+
+		SharedPool()
+			: mMemoryManager(MakeConfig()) {}
+	};
+
+	// Free blocks of the calling thread, handed back to the shared pool when the thread exits
+	struct ThreadCache
+	{
+		void* mBlocks[POOLED_CACHE_CAPACITY];
+		size_t mCount = 0;
+
+		~ThreadCache() { ReleaseBlocks(mBlocks, mCount); }
+	};
+
+	static MemoryManagerConfig MakeConfig();
+	static SharedPool& GetSharedPool();
+	static ThreadCache& GetThreadCache();
+
+	// Take up to count blocks from the shared pool into blocks. Returns the number taken
+	static size_t AcquireBlocks(void** blocks, size_t count);
+	static void ReleaseBlocks(void* const* blocks, size_t count);
+
+	static void* Allocate();
+	static void Free(void* block);
+};
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline MemoryManagerConfig Pooled<T, NumBlocksPerChunk>::MakeConfig()
+{
+	// Blocks follow one another from a cache-line aligned start, so each is aligned to sizeof(T) and thus to alignof(T), up to a cache line
+	static_assert(alignof(T) <= CACHE_LINE_SIZE, "Pooled types must not be over-aligned beyond a cache line");
+
+	SizeClassConfig sizeClass;
+	sizeClass.mBlockSize = BLOCKSIZE;
+	sizeClass.mInitialBlocks = NumBlocksPerChunk;
+	sizeClass.mGrowthPolicy = GrowthPolicy::Linear;
+
+	MemoryManagerConfig config;
+	config.mSizeClasses.push_back(sizeClass);
+	return config;
+}
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline typename Pooled<T, NumBlocksPerChunk>::SharedPool& Pooled<T, NumBlocksPerChunk>::GetSharedPool()
+{
+	static SharedPool* sharedPool = new SharedPool();
+	return *sharedPool;
+}
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline typename Pooled<T, NumBlocksPerChunk>::ThreadCache& Pooled<T, NumBlocksPerChunk>::GetThreadCache()
+{
+	thread_local ThreadCache threadCache;
+	return threadCache;
+}
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline size_t Pooled<T, NumBlocksPerChunk>::AcquireBlocks(void** blocks, size_t count)
+{
+	SharedPool& sharedPool = GetSharedPool();
+	std::lock_guard<std::mutex> lock(sharedPool.mMutex);
+	sharedPool.mMemoryManager.SetOwnerThread();
+
+	size_t acquiredCount = 0;
+	while (acquiredCount < count && (blocks[acquiredCount] = sharedPool.mMemoryManager.Allocate(BLOCKSIZE)) != nullptr)
+	{
+		acquiredCount++;
+	}
+
+	return acquiredCount;
+}
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline void Pooled<T, NumBlocksPerChunk>::ReleaseBlocks(void* const* blocks, size_t count)
+{
+	if (count == 0)
+	{
+		return;
+	}
+
+	SharedPool& sharedPool = GetSharedPool();
+	std::lock_guard<std::mutex> lock(sharedPool.mMutex);
+	sharedPool.mMemoryManager.SetOwnerThread();
+
+	for (size_t index = 0; index < count; index++)
+	{
+		sharedPool.mMemoryManager.Free(blocks[index], BLOCKSIZE);
+	}
+}
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline void* Pooled<T, NumBlocksPerChunk>::Allocate()
+{
+	ThreadCache& threadCache = GetThreadCache();
+	if (threadCache.mCount == 0)
+	{
+		// Refill half the cache under one lock
+		threadCache.mCount = AcquireBlocks(threadCache.mBlocks, POOLED_CACHE_CAPACITY / 2);
+		if (threadCache.mCount == 0)
+		{
+			return nullptr;
+		}
+	}
+
+	return threadCache.mBlocks[--threadCache.mCount];
+}
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline void Pooled<T, NumBlocksPerChunk>::Free(void* block)
+{
+	ThreadCache& threadCache = GetThreadCache();
+	if (threadCache.mCount == POOLED_CACHE_CAPACITY)
+	{
+		// Hand the older half back under one lock
+		ReleaseBlocks(threadCache.mBlocks, POOLED_CACHE_CAPACITY / 2);
+		memmove(threadCache.mBlocks, threadCache.mBlocks + POOLED_CACHE_CAPACITY / 2, (POOLED_CACHE_CAPACITY / 2) * sizeof(void*));
+		threadCache.mCount -= POOLED_CACHE_CAPACITY / 2;
+	}
+
+	threadCache.mBlocks[threadCache.mCount++] = block;
+}
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline void* Pooled<T, NumBlocksPerChunk>::operator new(size_t size)
+{
+	if (size != sizeof(T))
+	{
+		return ::operator new(size);
+	}
+
+	void* block = Allocate();
+	if (!block)
+	{
+		throw std::bad_alloc();
+	}
+
+	return block;
+}
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline void* Pooled<T, NumBlocksPerChunk>::operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	if (size != sizeof(T))
+	{
+		return ::operator new(size, std::nothrow);
+	}
+
+	return Allocate();
+}
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline void Pooled<T, NumBlocksPerChunk>::operator delete(void* block, size_t size) noexcept
+{
+	if (!block)
+	{
+		return;
+	}
+
+	// Size of the dynamic type, given a virtual destructor
+	if (size != sizeof(T))
+	{
+		::operator delete(block, size);
+		return;
+	}
+
+	Free(block);
+}
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline void Pooled<T, NumBlocksPerChunk>::operator delete(void* block, const std::nothrow_t&) noexcept
+{
+	// Only called when a constructor throws after a nothrow new. Without a size, the pool is asked whether the block is its own
+	if (!block)
+	{
+		return;
+	}
+
+	bool isPooled;
+	{
+		SharedPool& sharedPool = GetSharedPool();
+		std::lock_guard<std::mutex> lock(sharedPool.mMutex);
+		isPooled = sharedPool.mMemoryManager.GetBlockSize(block) != 0;
+	}
+
+	if (isPooled)
+	{
+		Free(block);
+	}
+	else
+	{
+		::operator delete(block, std::nothrow);
+	}
+}
+
+
+template<typename T, size_t NumBlocksPerChunk>
+inline size_t Pooled<T, NumBlocksPerChunk>::CountLive()
+{
+	SharedPool& sharedPool = GetSharedPool();
+	std::lock_guard<std::mutex> lock(sharedPool.mMutex);
+	sharedPool.mMemoryManager.SetOwnerThread();
+	return sharedPool.mMemoryManager.CountLive(BLOCKSIZE);
+}
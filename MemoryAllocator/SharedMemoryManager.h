@@ -0,0 +1,879 @@
+/* =========================================================================================
+*
+*	Class:		Shared Memory Manager
+*	Purpose:	Pool Memory Allocator over a memory segment shared between processes
+*	Author:		Sreyash (Srey) Raychaudhuri
+*	Date:		12/22/2024
+*
+* ==========================================================================================
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdio.h>
+
+#include "MemoryManagerConfig.h"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SHARED_SEGMENT_MAGIC	0x4C4F4F504D454D53ull	// "SMEMPOOL"
+#define SHARED_SEGMENT_VERSION	3
+#define MAX_SHARED_POOLS		16
+#define SHARED_ALIGNMENT		64
+
+// Free list heads pack a tag with the byte offset of the first free block, so a stale head fails the compare-exchange (ABA).
+// Offsets therefore have to fit in the low bits, capping a segment at 1 TiB
+#define SHARED_OFFSET_BITS		40
+#define SHARED_OFFSET_MASK		((uint64_t(1) << SHARED_OFFSET_BITS) - 1)
+
+// The atomics below live in memory mapped by several processes. That is only sound for lock-free (address-free) atomics
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared memory pools need lock-free 64-bit atomics");
+
+// One size class inside the segment. Every position is a byte offset from the start of the segment, never an address,
+// since each process maps the segment somewhere else. Each header fills whole cache lines, so processes hammering the free list of one pool
+// do not slow down the others
+struct alignas(SHARED_ALIGNMENT) SharedPoolHeader
+{
+	uint64_t mBlockSize;
+	uint64_t mNumBlocks;
+	uint64_t mBlocksOffset;
+	uint64_t mBitfieldOffset;
+
+	// [tag : 24][offset of first free block : 40]. Free blocks hold the offset of the next free block in their first word
+	std::atomic<uint64_t> mFreeListHead;
+
+	// Index of the first block never handed out. Blocks are carved from here when the free list is empty
+	std::atomic<uint64_t> mFirstUntouchedBlock;
+};
+
+// Layout: [[Segment header][Pool 0 bitfield][Pool 0 blocks][Pool 1 bitfield][Pool 1 blocks]...]
+struct SharedSegmentHeader
+{
+	uint64_t mMagic;
+	uint32_t mVersion;
+	uint32_t mNumPools;
+	uint64_t mSegmentBytes;
+
+	// Checksum of the header and bitfields as of the last Sync() of a file image. 0 while it has never been synced
+	uint64_t mChecksum;
+
+	// Offset of an application-defined root block (e.g. the top of an index), so it can be found again after reopening an image
+	std::atomic<uint64_t> mRootOffset;
+
+	SharedPoolHeader mPools[MAX_SHARED_POOLS];
+};
+
+// Pools in a POSIX shared memory object, Linux memfd or Windows named file mapping.
+// Processes hand each other blocks as offsets (see ToOffset / ToPointer); allocation and free are lock-free and safe across processes.
+// Pools do not grow: the segment is sized from the initial block counts of the config
+class SharedMemoryManager
+{
+public:
+	~SharedMemoryManager();
+
+	SharedMemoryManager(const SharedMemoryManager&) = delete;
+	SharedMemoryManager& operator=(const SharedMemoryManager&) = delete;
+
+	// Create a named segment with a pool per size class of config. Fails if the name is taken
+	static std::unique_ptr<SharedMemoryManager> Create(const char* name, const MemoryManagerConfig& config);
+
+	// Map a segment another process created
+	static std::unique_ptr<SharedMemoryManager> Open(const char* name);
+
+	// Create (or overwrite) a persistent image: the segment is a shared mapping of the file at path, so the pools outlive the process
+	static std::unique_ptr<SharedMemoryManager> CreateImage(const char* path, const MemoryManagerConfig& config);
+
+	// Map an image saved by Sync(), getting every pool back exactly as it was. Fails if the version or checksum does not match
+	static std::unique_ptr<SharedMemoryManager> OpenImage(const char* path);
+
+	// Stamp the checksum and write the mapping back to disk. No other thread or process may allocate or free while it runs.
+	// Crash consistency is limited to Sync() points: allocations and frees reach the file as they happen, but the checksum covers the header
+	// and bitfields as of the last Sync() only. An image changed since (a crash, or a close without Sync()) no longer matches it and OpenImage()
+	// refuses it. Block contents are not covered at all, so call Sync() where both the pools and the data in them are consistent
+	bool Sync();
+
+	// Sync() from the destructor of an image. Off by default, since other processes that still have the image mapped may be writing to it
+	void SetSyncOnClose(bool syncOnClose) { mSyncOnClose = syncOnClose; }
+
+	// Remove the name. Processes that have the segment open keep using it
+	static bool Unlink(const char* name);
+
+#if defined(__linux__)
+	// Create an unnamed segment backed by a memfd. Share it by passing GetFileDescriptor() to other processes (fork, SCM_RIGHTS)
+	static std::unique_ptr<SharedMemoryManager> CreateAnonymous(const MemoryManagerConfig& config);
+
+	// Map a memfd segment received from another process. Takes ownership of fd
+	static std::unique_ptr<SharedMemoryManager> OpenFileDescriptor(int fd);
+
+	int GetFileDescriptor() const { return mFileDescriptor; }
+#endif
+
+	// Offset of a free block from the smallest pool that fits size bytes. 0 if that pool is exhausted
+	uint64_t AllocateOffset(size_t size);
+
+	// Release the block at offset. Returns false for offsets that are not an allocated block
+	bool FreeOffset(uint64_t offset);
+
+	template<typename T>
+	T* Allocate() { return reinterpret_cast<T*>(ToPointer(AllocateOffset(sizeof(T)))); }
+
+	template<typename T>
+	void Free(T** ppBlock)
+	{
+		if (*ppBlock && FreeOffset(ToOffset(*ppBlock)))
+		{
+			*ppBlock = nullptr;
+		}
+	}
+
+	// Address of offset in this process's mapping; nullptr for offset 0
+	void* ToPointer(uint64_t offset) const { return offset ? mBase + offset : nullptr; }
+	uint64_t ToOffset(const void* pointer) const { return pointer ? static_cast<uint64_t>(reinterpret_cast<const char*>(pointer) - mBase) : 0; }
+
+	// Number of allocated blocks in the pool of the given size class
+	size_t CountLive(size_t sizeClass) const;
+
+	void SetRootOffset(uint64_t offset) { GetHeader()->mRootOffset.store(offset, std::memory_order_release); }
+	uint64_t GetRootOffset() const { return GetHeader()->mRootOffset.load(std::memory_order_acquire); }
+
+private:
+	SharedMemoryManager() = default;
+
+	SharedSegmentHeader* GetHeader() const { return reinterpret_cast<SharedSegmentHeader*>(mBase); }
+	std::atomic<uint64_t>* GetBitfield(const SharedPoolHeader& pool) const { return reinterpret_cast<std::atomic<uint64_t>*>(mBase + pool.mBitfieldOffset); }
+
+	// First word of a free block, holding the offset of the next free block
+	std::atomic<uint64_t>* GetLink(uint64_t offset) const { return reinterpret_cast<std::atomic<uint64_t>*>(mBase + offset); }
+
+	// Segment size for config, and the pool headers it implies. Returns 0 if config does not fit in a segment
+	static uint64_t LayoutSegment(const MemoryManagerConfig& config, SharedSegmentHeader& header);
+
+	// Write the header of a freshly created, zero-filled segment
+	void InitializeSegment(const SharedSegmentHeader& layout);
+
+	// Check the header of a segment mapped by Open
+	bool ValidateSegment(uint64_t mappedBytes) const;
+
+	// FNV-1a over the header (checksum field excluded) and every bitfield. Block contents are not covered
+	uint64_t ComputeChecksum() const;
+
+	// Write the mapping back to its file
+	bool FlushMapping();
+
+	void Unmap();
+
+	char* mBase = nullptr;
+	uint64_t mMappedBytes = 0;
+
+	// Segment is a persistent file image
+	bool mIsImage = false;
+	bool mSyncOnClose = false;
+
+#if defined(_WIN32)
+	HANDLE mMapping = nullptr;
+	HANDLE mFile = INVALID_HANDLE_VALUE;
+#else
+	int mFileDescriptor = -1;
+#endif
+};
+
+
+inline uint64_t SharedMemoryManager::LayoutSegment(const MemoryManagerConfig& config, SharedSegmentHeader& header)
+{
+	memset(static_cast<void*>(&header), 0, sizeof(header));
+
+	if (config.mSizeClasses.empty() || config.mSizeClasses.size() > MAX_SHARED_POOLS)
+	{
+		return 0;
+	}
+
+	uint64_t offset = (sizeof(SharedSegmentHeader) + SHARED_ALIGNMENT - 1) / SHARED_ALIGNMENT * SHARED_ALIGNMENT;
+	uint64_t previousBlockSize = 0;
+
+	for (const SizeClassConfig& sizeClass : config.mSizeClasses)
+	{
+		// Size classes have to ascend so AllocateOffset can take the first that fits
+		uint64_t blockSize = sizeClass.mBlockSize;
+		uint64_t numBlocks = sizeClass.mInitialBlocks;
+		if (blockSize < sizeof(uint64_t) || blockSize <= previousBlockSize || numBlocks == 0 || numBlocks > (SHARED_OFFSET_MASK / blockSize))
+		{
+			return 0;
+		}
+
+		SharedPoolHeader& pool = header.mPools[header.mNumPools++];
+		pool.mBlockSize = blockSize;
+		pool.mNumBlocks = numBlocks;
+
+		pool.mBitfieldOffset = offset;
+		offset += (numBlocks + 63) / 64 * sizeof(uint64_t);
+		offset = (offset + SHARED_ALIGNMENT - 1) / SHARED_ALIGNMENT * SHARED_ALIGNMENT;
+
+		pool.mBlocksOffset = offset;
+		offset += blockSize * numBlocks;
+		offset = (offset + SHARED_ALIGNMENT - 1) / SHARED_ALIGNMENT * SHARED_ALIGNMENT;
+
+		if (offset > SHARED_OFFSET_MASK)
+		{
+			return 0;
+		}
+
+		previousBlockSize = blockSize;
+	}
+
+	header.mMagic = SHARED_SEGMENT_MAGIC;
+	header.mVersion = SHARED_SEGMENT_VERSION;
+	header.mSegmentBytes = offset;
+	return offset;
+}
+
+
+inline void SharedMemoryManager::InitializeSegment(const SharedSegmentHeader& layout)
+{
+	// A new segment is zero-filled: bitfields are clear, free lists empty and every block untouched
+	SharedSegmentHeader* header = GetHeader();
+	header->mVersion = layout.mVersion;
+	header->mNumPools = layout.mNumPools;
+	header->mSegmentBytes = layout.mSegmentBytes;
+	header->mChecksum = 0;
+	header->mRootOffset.store(0, std::memory_order_relaxed);
+
+	for (uint32_t poolIndex = 0; poolIndex < layout.mNumPools; poolIndex++)
+	{
+		const SharedPoolHeader& source = layout.mPools[poolIndex];
+		SharedPoolHeader& pool = header->mPools[poolIndex];
+		pool.mBlockSize = source.mBlockSize;
+		pool.mNumBlocks = source.mNumBlocks;
+		pool.mBlocksOffset = source.mBlocksOffset;
+		pool.mBitfieldOffset = source.mBitfieldOffset;
+		pool.mFreeListHead.store(0, std::memory_order_relaxed);
+		pool.mFirstUntouchedBlock.store(0, std::memory_order_relaxed);
+	}
+
+	// Publish last: a process that sees the magic sees a complete header
+	std::atomic_thread_fence(std::memory_order_release);
+	header->mMagic = layout.mMagic;
+}
+
+
+inline bool SharedMemoryManager::ValidateSegment(uint64_t mappedBytes) const
+{
+	const SharedSegmentHeader* header = GetHeader();
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	if (mappedBytes < sizeof(SharedSegmentHeader) || header->mMagic != SHARED_SEGMENT_MAGIC || header->mVersion != SHARED_SEGMENT_VERSION ||
+		header->mNumPools > MAX_SHARED_POOLS || header->mSegmentBytes > mappedBytes)
+	{
+#ifdef _DEBUG
+		printf("[FAILURE] Not a shared memory pool segment\n");
+#endif // _DEBUG
+		return false;
+	}
+
+	for (uint32_t poolIndex = 0; poolIndex < header->mNumPools; poolIndex++)
+	{
+		// Blocks and bitfield must both lie within the segment, and the bitfield words must be aligned for atomic access
+		const SharedPoolHeader& pool = header->mPools[poolIndex];
+		if (pool.mBlockSize < sizeof(uint64_t) || pool.mBlocksOffset > header->mSegmentBytes ||
+			pool.mNumBlocks > (header->mSegmentBytes - pool.mBlocksOffset) / pool.mBlockSize ||
+			pool.mBitfieldOffset % sizeof(uint64_t) != 0 || pool.mBitfieldOffset > header->mSegmentBytes ||
+			(pool.mNumBlocks + 63) / 64 > (header->mSegmentBytes - pool.mBitfieldOffset) / sizeof(uint64_t))
+		{
+#ifdef _DEBUG
+			printf("[FAILURE] Pool %u lies outside the segment\n", poolIndex);
+#endif // _DEBUG
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+#if defined(_WIN32)
+
+inline std::unique_ptr<SharedMemoryManager> SharedMemoryManager::Create(const char* name, const MemoryManagerConfig& config)
+{
+	SharedSegmentHeader layout;
+	uint64_t segmentBytes = LayoutSegment(config, layout);
+	if (segmentBytes == 0)
+	{
+		return nullptr;
+	}
+
+	HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(segmentBytes >> 32), static_cast<DWORD>(segmentBytes), name);
+	if (!mapping || GetLastError() == ERROR_ALREADY_EXISTS)
+	{
+		if (mapping)
+		{
+			CloseHandle(mapping);
+		}
+		return nullptr;
+	}
+
+	std::unique_ptr<SharedMemoryManager> manager(new SharedMemoryManager());
+	manager->mMapping = mapping;
+	manager->mBase = reinterpret_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	if (!manager->mBase)
+	{
+		return nullptr;
+	}
+
+	manager->mMappedBytes = segmentBytes;
+	manager->InitializeSegment(layout);
+	return manager;
+}
+
+
+inline std::unique_ptr<SharedMemoryManager> SharedMemoryManager::Open(const char* name)
+{
+	HANDLE mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+	if (!mapping)
+	{
+		return nullptr;
+	}
+
+	std::unique_ptr<SharedMemoryManager> manager(new SharedMemoryManager());
+	manager->mMapping = mapping;
+	manager->mBase = reinterpret_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	if (!manager->mBase)
+	{
+		return nullptr;
+	}
+
+	MEMORY_BASIC_INFORMATION region;
+	VirtualQuery(manager->mBase, &region, sizeof(region));
+	manager->mMappedBytes = region.RegionSize;
+
+	return manager->ValidateSegment(manager->mMappedBytes) ? std::move(manager) : nullptr;
+}
+
+
+inline std::unique_ptr<SharedMemoryManager> SharedMemoryManager::CreateImage(const char* path, const MemoryManagerConfig& config)
+{
+	SharedSegmentHeader layout;
+	uint64_t segmentBytes = LayoutSegment(config, layout);
+	if (segmentBytes == 0)
+	{
+		return nullptr;
+	}
+
+	std::unique_ptr<SharedMemoryManager> manager(new SharedMemoryManager());
+	manager->mFile = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (manager->mFile == INVALID_HANDLE_VALUE)
+	{
+		return nullptr;
+	}
+
+	manager->mMapping = CreateFileMappingA(manager->mFile, nullptr, PAGE_READWRITE, static_cast<DWORD>(segmentBytes >> 32), static_cast<DWORD>(segmentBytes), nullptr);
+	manager->mBase = manager->mMapping ? reinterpret_cast<char*>(MapViewOfFile(manager->mMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0)) : nullptr;
+	if (!manager->mBase)
+	{
+		return nullptr;
+	}
+
+	manager->mMappedBytes = segmentBytes;
+	manager->mIsImage = true;
+	manager->InitializeSegment(layout);
+	return manager;
+}
+
+
+inline std::unique_ptr<SharedMemoryManager> SharedMemoryManager::OpenImage(const char* path)
+{
+	std::unique_ptr<SharedMemoryManager> manager(new SharedMemoryManager());
+	manager->mFile = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER fileSize;
+	if (manager->mFile == INVALID_HANDLE_VALUE || !GetFileSizeEx(manager->mFile, &fileSize))
+	{
+		return nullptr;
+	}
+
+	manager->mMapping = CreateFileMappingA(manager->mFile, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	manager->mBase = manager->mMapping ? reinterpret_cast<char*>(MapViewOfFile(manager->mMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0)) : nullptr;
+	if (!manager->mBase)
+	{
+		return nullptr;
+	}
+
+	manager->mMappedBytes = static_cast<uint64_t>(fileSize.QuadPart);
+	if (!manager->ValidateSegment(manager->mMappedBytes) || manager->ComputeChecksum() != manager->GetHeader()->mChecksum)
+	{
+#ifdef _DEBUG
+		printf("[FAILURE] Image %s is corrupt or was not synced\n", path);
+#endif // _DEBUG
+		return nullptr;
+	}
+
+	manager->mIsImage = true;
+	return manager;
+}
+
+
+inline bool SharedMemoryManager::FlushMapping()
+{
+	return FlushViewOfFile(mBase, 0) && (mFile == INVALID_HANDLE_VALUE || FlushFileBuffers(mFile));
+}
+
+
+inline bool SharedMemoryManager::Unlink(const char*)
+{
+	// Named mappings disappear with their last handle
+	return true;
+}
+
+
+inline void SharedMemoryManager::Unmap()
+{
+	if (mBase)
+	{
+		UnmapViewOfFile(mBase);
+		mBase = nullptr;
+	}
+
+	if (mMapping)
+	{
+		CloseHandle(mMapping);
+		mMapping = nullptr;
+	}
+
+	if (mFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(mFile);
+		mFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+#else
+
+// Size and map an open shared memory file descriptor. create truncates it to segmentBytes first
+inline char* MapSharedFile(int fd, uint64_t& segmentBytes, bool create)
+{
+	if (create)
+	{
+		if (ftruncate(fd, static_cast<off_t>(segmentBytes)) != 0)
+		{
+			return nullptr;
+		}
+	}
+	else
+	{
+		struct stat status;
+		if (fstat(fd, &status) != 0)
+		{
+			return nullptr;
+		}
+		segmentBytes = static_cast<uint64_t>(status.st_size);
+	}
+
+	void* memory = mmap(nullptr, segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return memory == MAP_FAILED ? nullptr : reinterpret_cast<char*>(memory);
+}
+
+
+inline std::unique_ptr<SharedMemoryManager> SharedMemoryManager::Create(const char* name, const MemoryManagerConfig& config)
+{
+	SharedSegmentHeader layout;
+	uint64_t segmentBytes = LayoutSegment(config, layout);
+	if (segmentBytes == 0)
+	{
+#ifdef _DEBUG
+		printf("[FAILURE] Config does not fit in a shared memory segment\n");
+#endif // _DEBUG
+		return nullptr;
+	}
+
+	std::unique_ptr<SharedMemoryManager> manager(new SharedMemoryManager());
+	manager->mFileDescriptor = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (manager->mFileDescriptor < 0)
+	{
+#ifdef _DEBUG
+		printf("[FAILURE] Could not create shared memory segment %s\n", name);
+#endif // _DEBUG
+		return nullptr;
+	}
+
+	manager->mBase = MapSharedFile(manager->mFileDescriptor, segmentBytes, true);
+	if (!manager->mBase)
+	{
+		shm_unlink(name);
+		return nullptr;
+	}
+
+	manager->mMappedBytes = segmentBytes;
+	manager->InitializeSegment(layout);
+	return manager;
+}
+
+
+inline std::unique_ptr<SharedMemoryManager> SharedMemoryManager::Open(const char* name)
+{
+	std::unique_ptr<SharedMemoryManager> manager(new SharedMemoryManager());
+	manager->mFileDescriptor = shm_open(name, O_RDWR, 0);
+	if (manager->mFileDescriptor < 0)
+	{
+		return nullptr;
+	}
+
+	uint64_t segmentBytes = 0;
+	manager->mBase = MapSharedFile(manager->mFileDescriptor, segmentBytes, false);
+	manager->mMappedBytes = segmentBytes;
+
+	return (manager->mBase && manager->ValidateSegment(segmentBytes)) ? std::move(manager) : nullptr;
+}
+
+
+inline bool SharedMemoryManager::Unlink(const char* name)
+{
+	return shm_unlink(name) == 0;
+}
+
+
+inline std::unique_ptr<SharedMemoryManager> SharedMemoryManager::CreateImage(const char* path, const MemoryManagerConfig& config)
+{
+	SharedSegmentHeader layout;
+	uint64_t segmentBytes = LayoutSegment(config, layout);
+	if (segmentBytes == 0)
+	{
+		return nullptr;
+	}
+
+	std::unique_ptr<SharedMemoryManager> manager(new SharedMemoryManager());
+	manager->mFileDescriptor = open(path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (manager->mFileDescriptor < 0)
+	{
+#ifdef _DEBUG
+		printf("[FAILURE] Could not create image %s\n", path);
+#endif // _DEBUG
+		return nullptr;
+	}
+
+	// The file is sparse until blocks are touched
+	manager->mBase = MapSharedFile(manager->mFileDescriptor, segmentBytes, true);
+	if (!manager->mBase)
+	{
+		return nullptr;
+	}
+
+	manager->mMappedBytes = segmentBytes;
+	manager->mIsImage = true;
+	manager->InitializeSegment(layout);
+	return manager;
+}
+
+
+inline std::unique_ptr<SharedMemoryManager> SharedMemoryManager::OpenImage(const char* path)
+{
+	std::unique_ptr<SharedMemoryManager> manager(new SharedMemoryManager());
+	manager->mFileDescriptor = open(path, O_RDWR);
+	if (manager->mFileDescriptor < 0)
+	{
+		return nullptr;
+	}
+
+	uint64_t segmentBytes = 0;
+	manager->mBase = MapSharedFile(manager->mFileDescriptor, segmentBytes, false);
+	manager->mMappedBytes = segmentBytes;
+	if (!manager->mBase || !manager->ValidateSegment(segmentBytes) || manager->ComputeChecksum() != manager->GetHeader()->mChecksum)
+	{
+#ifdef _DEBUG
+		printf("[FAILURE] Image %s is corrupt or was not synced\n", path);
+#endif // _DEBUG
+		return nullptr;
+	}
+
+	manager->mIsImage = true;
+	return manager;
+}
+
+
+inline bool SharedMemoryManager::FlushMapping()
+{
+	return msync(mBase, mMappedBytes, MS_SYNC) == 0;
+}
+
+
+#if defined(__linux__)
+
+inline std::unique_ptr<SharedMemoryManager> SharedMemoryManager::CreateAnonymous(const MemoryManagerConfig& config)
+{
+	SharedSegmentHeader layout;
+	uint64_t segmentBytes = LayoutSegment(config, layout);
+	if (segmentBytes == 0)
+	{
+		return nullptr;
+	}
+
+	std::unique_ptr<SharedMemoryManager> manager(new SharedMemoryManager());
+	manager->mFileDescriptor = memfd_create("SharedMemoryManager", 0);
+	if (manager->mFileDescriptor < 0)
+	{
+		return nullptr;
+	}
+
+	manager->mBase = MapSharedFile(manager->mFileDescriptor, segmentBytes, true);
+	if (!manager->mBase)
+	{
+		return nullptr;
+	}
+
+	manager->mMappedBytes = segmentBytes;
+	manager->InitializeSegment(layout);
+	return manager;
+}
+
+
+inline std::unique_ptr<SharedMemoryManager> SharedMemoryManager::OpenFileDescriptor(int fd)
+{
+	std::unique_ptr<SharedMemoryManager> manager(new SharedMemoryManager());
+	manager->mFileDescriptor = fd;
+
+	uint64_t segmentBytes = 0;
+	manager->mBase = MapSharedFile(fd, segmentBytes, false);
+	manager->mMappedBytes = segmentBytes;
+
+	return (manager->mBase && manager->ValidateSegment(segmentBytes)) ? std::move(manager) : nullptr;
+}
+
+#endif // __linux__
+
+
+inline void SharedMemoryManager::Unmap()
+{
+	if (mBase)
+	{
+		munmap(mBase, mMappedBytes);
+		mBase = nullptr;
+	}
+
+	if (mFileDescriptor >= 0)
+	{
+		close(mFileDescriptor);
+		mFileDescriptor = -1;
+	}
+}
+
+#endif // _WIN32
+
+
+inline SharedMemoryManager::~SharedMemoryManager()
+{
+	if (mIsImage && mSyncOnClose && mBase)
+	{
+		Sync();
+	}
+
+	Unmap();
+}
+
+
+inline uint64_t SharedMemoryManager::ComputeChecksum() const
+{
+	const uint64_t fnvPrime = 0x100000001B3ull;
+	uint64_t checksum = 0xCBF29CE484222325ull;
+
+	auto hashWord = [&checksum, fnvPrime](uint64_t word)
+		{
+			checksum ^= word;
+			checksum *= fnvPrime;
+		};
+
+	const SharedSegmentHeader* header = GetHeader();
+	hashWord(header->mMagic);
+	hashWord((uint64_t(header->mVersion) << 32) | header->mNumPools);
+	hashWord(header->mSegmentBytes);
+	hashWord(header->mRootOffset.load(std::memory_order_relaxed));
+
+	for (uint32_t poolIndex = 0; poolIndex < header->mNumPools; poolIndex++)
+	{
+		const SharedPoolHeader& pool = header->mPools[poolIndex];
+		hashWord(pool.mBlockSize);
+		hashWord(pool.mNumBlocks);
+		hashWord(pool.mBlocksOffset);
+		hashWord(pool.mBitfieldOffset);
+		hashWord(pool.mFreeListHead.load(std::memory_order_relaxed));
+		hashWord(pool.mFirstUntouchedBlock.load(std::memory_order_relaxed));
+
+		// Pool offsets come from the file; do not read past the mapping if they are corrupt
+		uint64_t numWords = (pool.mNumBlocks + 63) / 64;
+		if (pool.mBitfieldOffset > mMappedBytes || numWords > (mMappedBytes - pool.mBitfieldOffset) / sizeof(uint64_t))
+		{
+			return ~header->mChecksum;
+		}
+
+		const std::atomic<uint64_t>* bitfield = GetBitfield(pool);
+		for (uint64_t wordIndex = 0; wordIndex < numWords; wordIndex++)
+		{
+			hashWord(bitfield[wordIndex].load(std::memory_order_relaxed));
+		}
+	}
+
+	return checksum;
+}
+
+
+inline bool SharedMemoryManager::Sync()
+{
+	if (!mIsImage)
+	{
+		return false;
+	}
+
+	GetHeader()->mChecksum = ComputeChecksum();
+	return FlushMapping();
+}
+
+
+inline uint64_t SharedMemoryManager::AllocateOffset(size_t size)
+{
+	SharedSegmentHeader* header = GetHeader();
+
+	uint32_t poolIndex = 0;
+	while (poolIndex < header->mNumPools && header->mPools[poolIndex].mBlockSize < size)
+	{
+		poolIndex++;
+	}
+
+	if (poolIndex == header->mNumPools)
+	{
+		return 0;
+	}
+
+	SharedPoolHeader& pool = header->mPools[poolIndex];
+	uint64_t blockOffset = 0;
+
+	while (blockOffset == 0)
+	{
+		// Pop the first free block. The tag changes on every update, so a head that was popped and pushed back in between fails the exchange
+		uint64_t head = pool.mFreeListHead.load(std::memory_order_acquire);
+		while (head & SHARED_OFFSET_MASK)
+		{
+			uint64_t next = GetLink(head & SHARED_OFFSET_MASK)->load(std::memory_order_relaxed);
+			uint64_t newHead = (((head >> SHARED_OFFSET_BITS) + 1) << SHARED_OFFSET_BITS) | next;
+			if (pool.mFreeListHead.compare_exchange_weak(head, newHead, std::memory_order_acquire, std::memory_order_acquire))
+			{
+				blockOffset = head & SHARED_OFFSET_MASK;
+				break;
+			}
+		}
+
+		if (blockOffset)
+		{
+			break;
+		}
+
+		// Free list is empty: carve an untouched block
+		uint64_t untouched = pool.mFirstUntouchedBlock.load(std::memory_order_relaxed);
+		while (untouched < pool.mNumBlocks && !pool.mFirstUntouchedBlock.compare_exchange_weak(untouched, untouched + 1, std::memory_order_relaxed))
+		{
+		}
+
+		if (untouched < pool.mNumBlocks)
+		{
+			blockOffset = pool.mBlocksOffset + untouched * pool.mBlockSize;
+		}
+		else if ((pool.mFreeListHead.load(std::memory_order_acquire) & SHARED_OFFSET_MASK) == 0)
+		{
+#ifdef _DEBUG
+			printf("[FAILURE] Shared pool exhausted!\n");
+#endif // _DEBUG
+			return 0;
+		}
+	}
+
+	uint64_t blockIndex = (blockOffset - pool.mBlocksOffset) / pool.mBlockSize;
+	GetBitfield(pool)[blockIndex / 64].fetch_or(uint64_t(1) << (blockIndex % 64), std::memory_order_relaxed);
+
+	return blockOffset;
+}
+
+
+inline bool SharedMemoryManager::FreeOffset(uint64_t offset)
+{
+	SharedSegmentHeader* header = GetHeader();
+
+	for (uint32_t poolIndex = 0; poolIndex < header->mNumPools; poolIndex++)
+	{
+		SharedPoolHeader& pool = header->mPools[poolIndex];
+		if (offset < pool.mBlocksOffset || offset >= pool.mBlocksOffset + pool.mNumBlocks * pool.mBlockSize)
+		{
+			continue;
+		}
+
+		uint64_t blockIndex = (offset - pool.mBlocksOffset) / pool.mBlockSize;
+		if (pool.mBlocksOffset + blockIndex * pool.mBlockSize != offset)
+		{
+			break;
+		}
+
+		// Clearing the bit first makes a concurrent double free lose the race instead of linking the block twice
+		uint64_t statusMask = uint64_t(1) << (blockIndex % 64);
+		if ((GetBitfield(pool)[blockIndex / 64].fetch_and(~statusMask, std::memory_order_relaxed) & statusMask) == 0)
+		{
+#ifdef _DEBUG
+			printf("[FAILURE] Attempting a double free!\n");
+#endif // _DEBUG
+			return false;
+		}
+
+		uint64_t head = pool.mFreeListHead.load(std::memory_order_relaxed);
+		uint64_t newHead;
+		do
+		{
+			GetLink(offset)->store(head & SHARED_OFFSET_MASK, std::memory_order_relaxed);
+			newHead = (((head >> SHARED_OFFSET_BITS) + 1) << SHARED_OFFSET_BITS) | offset;
+		} while (!pool.mFreeListHead.compare_exchange_weak(head, newHead, std::memory_order_release, std::memory_order_relaxed));
+
+		return true;
+	}
+
+#ifdef _DEBUG
+	printf("[FAILURE] Offset is not a block of this segment!\n");
+#endif // _DEBUG
+	return false;
+}
+
+
+inline size_t SharedMemoryManager::CountLive(size_t sizeClass) const
+{
+	const SharedSegmentHeader* header = GetHeader();
+
+	for (uint32_t poolIndex = 0; poolIndex < header->mNumPools; poolIndex++)
+	{
+		const SharedPoolHeader& pool = header->mPools[poolIndex];
+		if (pool.mBlockSize != sizeClass)
+		{
+			continue;
+		}
+
+		size_t count = 0;
+		const std::atomic<uint64_t>* bitfield = GetBitfield(pool);
+		for (uint64_t wordIndex = 0; wordIndex < (pool.mNumBlocks + 63) / 64; wordIndex++)
+		{
+			for (uint64_t word = bitfield[wordIndex].load(std::memory_order_relaxed); word; word &= word - 1)
+			{
+				count++;
+			}
+		}
+
+		return count;
+	}
+
+	return 0;
+}